@@ -0,0 +1,329 @@
+/*
+ * Batch regression runner for the LC-2K simulators.
+ *
+ * Runs every job in a manifest on a pool of worker threads and compares each
+ * job's output against its golden file while the simulator is still
+ * producing it, then prints one pass/fail line per job with its wall time.
+ *
+ * usage: batch [-j threads] <manifest>
+ *
+ * Each manifest line is
+ *     <expected output> <simulator> <simulator arguments...>
+ * where <simulator> is p1, p2, p3 or p4 and the arguments are the ones that
+ * simulator takes on its own command line, for example
+ *     ../p4/test0.out p4 ../p4/test0.mc 4 2 1
+ * Blank lines and lines starting with # are skipped.  Paths are relative to
+ * the current directory.
+ *
+ * The simulators are linked in whole (see the Makefile), each job getting
+ * its own machine state on its worker's stack and its own trace stream.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define MAXLINELENGTH 1000
+#define MAXARGS 16
+#define MAXTHREADS 256
+#define WORKERSTACK (64 << 20) /* simulators keep whole machine states on the stack */
+
+int p1Main(int, char *[]);
+int p2Main(int, char *[]);
+int p3Main(int, char *[]);
+int p4Main(int, char *[]);
+
+typedef struct simulatorStruct {
+    char *name;
+    int (*main)(int, char *[]);
+} simulatorType;
+
+simulatorType simulators[] = {
+    { "p1", p1Main },
+    { "p2", p2Main },
+    { "p3", p3Main },
+    { "p4", p4Main },
+};
+
+#define NUMSIMULATORS (int)(sizeof(simulators) / sizeof(simulators[0]))
+
+typedef struct jobStruct {
+    char *line; /* the manifest line, split in place into the fields below */
+    char *expected;
+    simulatorType *simulator;
+    int argc;
+    char *argv[MAXARGS + 1];
+    char *golden; /* contents of the expected file */
+    long goldenLength;
+    long compared; /* bytes of output compared so far */
+    long mismatch; /* offset of the first differing byte, -1 if none */
+    int status; /* the simulator's exit status */
+    double seconds;
+} jobType;
+
+/* Per-worker job deque: the owner pops from the tail, thieves take the head */
+typedef struct dequeStruct {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+} dequeType;
+
+jobType *jobs;
+int numJobs;
+dequeType deques[MAXTHREADS];
+int numThreads;
+
+void readManifest(char *);
+char *readFile(char *, long *);
+void *worker(void *);
+int takeJob(int);
+void runJob(jobType *);
+void compareOutput(void *, const char *, size_t);
+int lineOf(jobType *, long);
+double now(void);
+
+int main(int argc, char *argv[]) {
+    int i;
+
+    numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 4 && strcmp(argv[1], "-j")==0) {
+        numThreads = atoi(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2 || numThreads < 1) {
+        printf("error: usage: %s [-j threads] <manifest>\n", argv[0]);
+        exit(1);
+    }
+    if (numThreads > MAXTHREADS)
+        numThreads = MAXTHREADS;
+
+    readManifest(argv[1]);
+    if (numThreads > numJobs && numJobs > 0)
+        numThreads = numJobs;
+
+    /* deal the jobs out round-robin; idle workers steal the rest */
+    for (i=0; i<numThreads; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].jobs = malloc((numJobs / numThreads + 1) * sizeof(int));
+        deques[i].head = 0;
+        deques[i].tail = 0;
+    }
+    for (i=0; i<numJobs; i++) {
+        dequeType *deque = &deques[i % numThreads];
+        deque->jobs[deque->tail++] = i;
+    }
+
+    double start = now();
+    pthread_t threads[MAXTHREADS];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKERSTACK);
+    for (i=0; i<numThreads; i++) {
+        if (pthread_create(&threads[i], &attr, worker, (void *)(long)i) != 0) {
+            printf("error: can't start worker thread\n");
+            exit(1);
+        }
+    }
+    for (i=0; i<numThreads; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    int failed = 0;
+    for (i=0; i<numJobs; i++) {
+        jobType *job = &jobs[i];
+        char reason[100] = "";
+        if (job->status != 0)
+            sprintf(reason, "exit status %d", job->status);
+        else if (job->mismatch >= 0)
+            sprintf(reason, "output differs at line %d", lineOf(job, job->mismatch));
+        else if (job->compared < job->goldenLength)
+            sprintf(reason, "output ends early at line %d", lineOf(job, job->compared));
+        if (reason[0] != '\0')
+            failed++;
+
+        printf("%s %8.3f s  %s", reason[0] ? "FAIL" : "PASS", job->seconds, job->simulator->name);
+        int j;
+        for (j=1; j<job->argc; j++)
+            printf(" %s", job->argv[j]);
+        if (reason[0])
+            printf("  (%s)", reason);
+        printf("\n");
+    }
+    printf("%d passed, %d failed, %.3f s on %d threads\n", numJobs - failed, failed, elapsed, numThreads);
+
+    return(failed ? 1 : 0);
+}
+
+void readManifest(char *fileName) {
+    char line[MAXLINELENGTH];
+    int capacity = 64;
+    FILE *filePtr = fopen(fileName, "r");
+    if (filePtr == NULL) {
+        printf("error: can't open file %s\n", fileName);
+        perror("fopen");
+        exit(1);
+    }
+
+    jobs = malloc(capacity * sizeof(jobType));
+    numJobs = 0;
+    while (fgets(line, MAXLINELENGTH, filePtr) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(filePtr)) {
+            printf("error: line too long in %s\n", fileName);
+            exit(1);
+        }
+        if (numJobs == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, capacity * sizeof(jobType));
+        }
+        jobType *job = &jobs[numJobs];
+        job->line = strdup(line);
+
+        char *words[MAXARGS + 2];
+        int numWords = 0;
+        char *word = strtok(job->line, " \t\r\n");
+        if (word == NULL || word[0] == '#') {
+            free(job->line);
+            continue;
+        }
+        while (word != NULL) {
+            if (numWords == MAXARGS + 1) {
+                printf("error: too many arguments in %s: %s", fileName, line);
+                exit(1);
+            }
+            words[numWords++] = word;
+            word = strtok(NULL, " \t\r\n");
+        }
+        if (numWords < 3) {
+            printf("error: bad manifest line: %s", line);
+            exit(1);
+        }
+
+        int i;
+        job->simulator = NULL;
+        for (i=0; i<NUMSIMULATORS; i++)
+            if (strcmp(simulators[i].name, words[1])==0)
+                job->simulator = &simulators[i];
+        if (job->simulator == NULL) {
+            printf("error: unknown simulator %s\n", words[1]);
+            exit(1);
+        }
+
+        job->expected = words[0];
+        job->argc = numWords - 1;
+        for (i=0; i<job->argc; i++)
+            job->argv[i] = words[i + 1];
+        job->argv[job->argc] = NULL;
+        job->golden = readFile(job->expected, &job->goldenLength);
+        numJobs++;
+    }
+    fclose(filePtr);
+}
+
+char *readFile(char *fileName, long *length) {
+    FILE *filePtr = fopen(fileName, "rb");
+    if (filePtr == NULL) {
+        printf("error: can't open file %s\n", fileName);
+        perror("fopen");
+        exit(1);
+    }
+    fseek(filePtr, 0, SEEK_END);
+    *length = ftell(filePtr);
+    rewind(filePtr);
+    char *contents = malloc(*length + 1);
+    if (contents == NULL || fread(contents, 1, *length, filePtr) != (size_t)*length) {
+        printf("error: can't read file %s\n", fileName);
+        exit(1);
+    }
+    fclose(filePtr);
+    return contents;
+}
+
+void *worker(void *arg) {
+    int self = (int)(long)arg;
+    int next;
+    while ((next = takeJob(self)) >= 0)
+        runJob(&jobs[next]);
+    return NULL;
+}
+
+/*
+ * Take the newest job from our own deque, or failing that the oldest job
+ * from someone else's.  Returns -1 once every deque is empty.
+ */
+int takeJob(int self) {
+    int i;
+    for (i=0; i<numThreads; i++) {
+        dequeType *deque = &deques[(self + i) % numThreads];
+        int next = -1;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head < deque->tail)
+            next = (i == 0) ? deque->jobs[--deque->tail] : deque->jobs[deque->head++];
+        pthread_mutex_unlock(&deque->lock);
+        if (next >= 0)
+            return next;
+    }
+    return -1;
+}
+
+void runJob(jobType *job) {
+    jmp_buf done;
+    traceType *trace = traceCreate(compareOutput, job);
+    job->compared = 0;
+    job->mismatch = -1;
+
+    double start = now();
+    traceSelect(trace);
+    int caught = setjmp(done);
+    if (caught == 0) {
+        traceCatchExit(&done);
+        job->status = job->simulator->main(job->argc, job->argv);
+    } else
+        job->status = caught - 1;
+    traceCatchExit(NULL);
+    traceFinish(trace);
+    job->seconds = now() - start;
+
+    traceDestroy(trace);
+}
+
+/*
+ * Trace sink: check the next piece of a job's output against its golden
+ * file.  Runs on the trace writer thread, in output order.
+ */
+void compareOutput(void *arg, const char *data, size_t length) {
+    jobType *job = arg;
+    if (job->mismatch >= 0)
+        return;
+    size_t i;
+    for (i=0; i<length; i++) {
+        if (job->compared + (long)i >= job->goldenLength || data[i] != job->golden[job->compared + i]) {
+            job->mismatch = job->compared + i;
+            return;
+        }
+    }
+    job->compared += length;
+}
+
+/* line number, counting from 1, of a byte offset into a job's golden file */
+int lineOf(jobType *job, long offset) {
+    int line = 1;
+    long i;
+    for (i=0; i<offset && i<job->goldenLength; i++)
+        if (job->golden[i] == '\n')
+            line++;
+    return line;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mcimage.h"
+
+#define MAXLINELENGTH 1000
+
+static int hostIsBigEndian(void) {
+    unsigned int one = 1;
+    return *(unsigned char *)&one == 0;
+}
+
+static void putWord(unsigned char *bytes, unsigned int word) {
+    bytes[0] = word & 0xFF;
+    bytes[1] = (word >> 8) & 0xFF;
+    bytes[2] = (word >> 16) & 0xFF;
+    bytes[3] = (word >> 24) & 0xFF;
+}
+
+static unsigned int getWord(unsigned char *bytes) {
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned int)bytes[3] << 24;
+}
+
+static void swapWords(int *words, int numWords) {
+    int i;
+    for (i=0; i<numWords; i++)
+        words[i] = getWord((unsigned char *)&words[i]);
+}
+
+/*
+ * Write numWords words as a binary image starting execution at entry.
+ * Return 1 on success, 0 on a write error.
+ */
+int writeImage(FILE *filePtr, const int *words, int numWords, int entry) {
+    unsigned char header[MCHEADERSIZE];
+    memcpy(header, MCMAGIC, 4);
+    putWord(header + 4, MCVERSION);
+    putWord(header + 8, numWords);
+    putWord(header + 12, entry);
+    if (fwrite(header, 1, MCHEADERSIZE, filePtr) != MCHEADERSIZE)
+        return 0;
+
+    if (!hostIsBigEndian())
+        return fwrite(words, sizeof(int), numWords, filePtr) == (size_t)numWords;
+
+    int i;
+    for (i=0; i<numWords; i++) {
+        unsigned char bytes[4];
+        putWord(bytes, words[i]);
+        if (fwrite(bytes, 1, 4, filePtr) != 4)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Read a text or binary machine-code file into mem, which holds maxWords
+ * words.  The entry point is stored in *entry (always 0 for text files).
+ * Return the number of words read, or -1 after printing an error.
+ */
+int loadImage(FILE *filePtr, int *mem, int maxWords, int *entry) {
+    int numWords;
+    int c = getc(filePtr);
+    if (c != EOF)
+        ungetc(c, filePtr);
+
+    if (c == MCMAGIC[0]) {
+        unsigned char header[MCHEADERSIZE];
+        if (fread(header, 1, MCHEADERSIZE, filePtr) != MCHEADERSIZE ||
+                memcmp(header, MCMAGIC, 4) != 0) {
+            printf("error: bad machine-code image header\n");
+            return -1;
+        }
+        if (getWord(header + 4) != MCVERSION) {
+            printf("error: unsupported machine-code image version %u\n", getWord(header + 4));
+            return -1;
+        }
+        numWords = getWord(header + 8);
+        *entry = getWord(header + 12);
+        if (numWords < 0 || numWords > maxWords) {
+            printf("exceeded memory size\n");
+            return -1;
+        }
+        /* words go straight into simulated memory in one read */
+        if (fread(mem, sizeof(int), numWords, filePtr) != (size_t)numWords) {
+            printf("error in reading address %d\n", numWords);
+            return -1;
+        }
+        if (hostIsBigEndian())
+            swapWords(mem, numWords);
+        return numWords;
+    }
+
+    char line[MAXLINELENGTH];
+    *entry = 0;
+    for (numWords = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL; numWords++) {
+        if (numWords >= maxWords) {
+            printf("exceeded memory size\n");
+            return -1;
+        }
+        if (sscanf(line, "%d", mem+numWords) != 1) {
+            printf("error in reading address %d\n", numWords);
+            return -1;
+        }
+    }
+    return numWords;
+}
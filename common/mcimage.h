@@ -0,0 +1,30 @@
+/*
+ * LC-2K machine-code images.
+ *
+ * Machine code is either the classic text format (one decimal word per
+ * line) or a binary image:
+ *
+ *     offset 0   "LC2K" magic
+ *     offset 4   format version (MCVERSION)
+ *     offset 8   number of words
+ *     offset 12  entry point (initial pc)
+ *     offset 16  the words themselves
+ *
+ * Every header field and word is a little-endian 32-bit integer.  Readers
+ * tell the two apart by the first byte, since text machine code never
+ * starts with 'L'.
+ */
+
+#ifndef MCIMAGE_H
+#define MCIMAGE_H
+
+#include <stdio.h>
+
+#define MCMAGIC "LC2K"
+#define MCVERSION 1
+#define MCHEADERSIZE 16
+
+int writeImage(FILE *, const int *, int, int);
+int loadImage(FILE *, int *, int, int *);
+
+#endif
@@ -0,0 +1,348 @@
+#define _POSIX_C_SOURCE 200809L /* nanosleep under -std=c99 */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TRACECHUNKSIZE (256 * 1024) /* bytes per chunk */
+#define TRACECHUNKS 16 /* chunks in each stream's ring */
+#define TRACEMAXPRINTF 1024 /* longest tracePrintf output */
+#define TRACESIGNALPOLLS 100 /* 10ms polls for the writer after a crash */
+
+typedef struct chunkStruct {
+    struct chunkStruct *next;
+    traceType *owner;
+    size_t length;
+    char data[TRACECHUNKSIZE];
+} chunkType;
+
+struct traceStruct {
+    traceSinkType sink;
+    void *arg;
+    chunkType *current; /* chunk being filled by the owning thread */
+    chunkType *freeChunks;
+    int inFlight; /* chunks queued for or being written by the writer */
+};
+
+/* Writer thread state, all guarded by traceLock */
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunkQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t chunkWritten = PTHREAD_COND_INITIALIZER;
+static chunkType *queueHead = NULL, *queueTail = NULL;
+static pthread_t writerThread;
+static int writerRunning = 0;
+static int writerStopping = 0;
+
+static int traceDirect = 0; /* LC2K_TRACE=stdio */
+static traceType *stdoutTrace = NULL;
+static __thread traceType *currentTrace = NULL;
+static __thread jmp_buf *currentExit = NULL;
+
+static void *writerMain(void *unused) {
+    pthread_mutex_lock(&traceLock);
+    while (1) {
+        while (queueHead == NULL && !writerStopping)
+            pthread_cond_wait(&chunkQueued, &traceLock);
+        if (queueHead == NULL)
+            break;
+        chunkType *chunk = queueHead;
+        queueHead = chunk->next;
+        if (queueHead == NULL)
+            queueTail = NULL;
+        pthread_mutex_unlock(&traceLock);
+
+        chunk->owner->sink(chunk->owner->arg, chunk->data, chunk->length);
+
+        pthread_mutex_lock(&traceLock);
+        traceType *trace = chunk->owner;
+        chunk->length = 0;
+        chunk->next = trace->freeChunks;
+        trace->freeChunks = chunk;
+        trace->inFlight--;
+        pthread_cond_broadcast(&chunkWritten);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return NULL;
+}
+
+static void startWriter(void) {
+    pthread_mutex_lock(&traceLock);
+    if (!writerRunning) {
+        if (pthread_create(&writerThread, NULL, writerMain, NULL) != 0) {
+            fprintf(stderr, "error: can't start trace writer\n");
+            exit(1);
+        }
+        writerRunning = 1;
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+static void stopWriter(void) {
+    pthread_mutex_lock(&traceLock);
+    int running = writerRunning;
+    writerStopping = 1;
+    pthread_cond_signal(&chunkQueued);
+    pthread_mutex_unlock(&traceLock);
+    if (running)
+        pthread_join(writerThread, NULL);
+    writerRunning = 0;
+    writerStopping = 0;
+}
+
+static void writeFd(void *arg, const char *data, size_t length) {
+    int fd = *(int *)arg;
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) {
+            perror("trace write");
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+/*
+ * Queue the current chunk for the writer and take a free one, waiting for
+ * the writer to catch up if the whole ring is in flight.
+ */
+static void flushChunk(traceType *trace) {
+    pthread_mutex_lock(&traceLock);
+    if (trace->current->length > 0) {
+        chunkType *chunk = trace->current;
+        chunk->next = NULL;
+        if (queueTail != NULL)
+            queueTail->next = chunk;
+        else
+            queueHead = chunk;
+        queueTail = chunk;
+        trace->inFlight++;
+        pthread_cond_signal(&chunkQueued);
+
+        while (trace->freeChunks == NULL)
+            pthread_cond_wait(&chunkWritten, &traceLock);
+        trace->current = trace->freeChunks;
+        trace->freeChunks = trace->current->next;
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+/*
+ * Make room for length bytes in the current chunk.
+ */
+static char *reserve(size_t length) {
+    traceType *trace = currentTrace;
+    if (trace->current->length + length > TRACECHUNKSIZE)
+        flushChunk(trace);
+    return trace->current->data + trace->current->length;
+}
+
+static void exitTrace(void) {
+    if (stdoutTrace != NULL) {
+        traceFinish(stdoutTrace);
+        stopWriter();
+    }
+    fflush(stdout);
+}
+
+/*
+ * A simulator that crashes on a bad program would otherwise lose whatever
+ * is still buffered.  Give the writer up to a second to drain the queue,
+ * write out the chunk being filled, then die of the original signal.  If
+ * the writer is stuck (it may be the thread that crashed) the chunk is
+ * dropped rather than written ahead of output still queued.  Only
+ * async-signal-safe calls are made here.
+ */
+static void fatalSignal(int sig) {
+    traceType *trace = stdoutTrace;
+    if (trace != NULL) {
+        struct timespec poll = {0, 10 * 1000 * 1000};
+        int polls = 0;
+        while (__atomic_load_n(&trace->inFlight, __ATOMIC_ACQUIRE) > 0
+                && polls < TRACESIGNALPOLLS) {
+            nanosleep(&poll, NULL);
+            polls++;
+        }
+        if (__atomic_load_n(&trace->inFlight, __ATOMIC_ACQUIRE) == 0) {
+            int fd = *(int *)trace->arg;
+            const char *data = trace->current->data;
+            size_t length = trace->current->length;
+            while (length > 0) {
+                ssize_t written = write(fd, data, length);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    break;
+                data += written;
+                length -= written;
+            }
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Send this thread's trace output to stdout.  Called once at the start of
+ * main, before anything is printed; everything still buffered is written
+ * out when the program exits.  Does nothing if the thread already has a
+ * stream, as it does when a simulator runs as a batch job.
+ */
+void traceInit(void) {
+    if (currentTrace != NULL)
+        return;
+    char *mode = getenv("LC2K_TRACE");
+    traceDirect = (mode != NULL && strcmp(mode, "stdio")==0);
+    if (traceDirect)
+        return;
+    static int stdoutFd = 1;
+    stdoutTrace = traceCreate(writeFd, &stdoutFd);
+    traceSelect(stdoutTrace);
+    atexit(exitTrace);
+    signal(SIGSEGV, fatalSignal);
+    signal(SIGBUS, fatalSignal);
+    signal(SIGFPE, fatalSignal);
+}
+
+/*
+ * Create a stream whose output is handed to sink(arg, data, length) on the
+ * writer thread, in order.
+ */
+traceType *traceCreate(traceSinkType sink, void *arg) {
+    traceType *trace = calloc(1, sizeof(traceType));
+    if (trace == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    trace->sink = sink;
+    trace->arg = arg;
+    int i;
+    for (i=0; i<TRACECHUNKS; i++) {
+        chunkType *chunk = malloc(sizeof(chunkType));
+        if (chunk == NULL) {
+            fprintf(stderr, "error: out of memory\n");
+            exit(1);
+        }
+        chunk->owner = trace;
+        chunk->length = 0;
+        chunk->next = trace->freeChunks;
+        trace->freeChunks = chunk;
+    }
+    trace->current = trace->freeChunks;
+    trace->freeChunks = trace->current->next;
+    startWriter();
+    return trace;
+}
+
+/* Direct the calling thread's trace output to trace */
+void traceSelect(traceType *trace) {
+    currentTrace = trace;
+}
+
+/* Hand over everything buffered and wait until the sink has seen it */
+void traceFinish(traceType *trace) {
+    flushChunk(trace);
+    pthread_mutex_lock(&traceLock);
+    while (trace->inFlight > 0)
+        pthread_cond_wait(&chunkWritten, &traceLock);
+    pthread_mutex_unlock(&traceLock);
+}
+
+void traceDestroy(traceType *trace) {
+    traceFinish(trace);
+    free(trace->current);
+    while (trace->freeChunks != NULL) {
+        chunkType *next = trace->freeChunks->next;
+        free(trace->freeChunks);
+        trace->freeChunks = next;
+    }
+    if (currentTrace == trace)
+        currentTrace = NULL;
+    free(trace);
+}
+
+void traceStr(const char *str) {
+    if (traceDirect) {
+        fputs(str, stdout);
+        return;
+    }
+    size_t length = strlen(str);
+    while (length > 0) {
+        size_t piece = length < TRACECHUNKSIZE ? length : TRACECHUNKSIZE;
+        memcpy(reserve(piece), str, piece);
+        currentTrace->current->length += piece;
+        str += piece;
+        length -= piece;
+    }
+}
+
+void traceChar(char c) {
+    if (traceDirect) {
+        putchar(c);
+        return;
+    }
+    *reserve(1) = c;
+    currentTrace->current->length++;
+}
+
+void traceInt(int value) {
+    if (traceDirect) {
+        printf("%d", value);
+        return;
+    }
+    char digits[12];
+    int n = 0;
+    /* work in unsigned so INT_MIN negates cleanly */
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+        digits[n++] = '-';
+
+    char *out = reserve(n);
+    int i;
+    for (i=0; i<n; i++)
+        out[i] = digits[n - 1 - i];
+    currentTrace->current->length += n;
+}
+
+/* printf for cold paths such as error messages */
+void tracePrintf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (traceDirect) {
+        vprintf(format, args);
+    } else {
+        char *out = reserve(TRACEMAXPRINTF);
+        int n = vsnprintf(out, TRACEMAXPRINTF, format, args);
+        if (n >= TRACEMAXPRINTF)
+            n = TRACEMAXPRINTF - 1;
+        if (n > 0)
+            currentTrace->current->length += n;
+    }
+    va_end(args);
+}
+
+/*
+ * Make traceExit(status) on this thread longjmp to where instead of ending
+ * the process; setjmp returns status + 1 there.  NULL restores exit().
+ */
+void traceCatchExit(jmp_buf *where) {
+    currentExit = where;
+}
+
+void traceExit(int status) {
+    if (currentExit != NULL)
+        longjmp(*currentExit, status + 1);
+    exit(status);
+}
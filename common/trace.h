@@ -0,0 +1,40 @@
+/*
+ * Buffered trace output shared by the simulators.
+ *
+ * Each thread writes into its own trace stream: a small ring of large
+ * chunks.  Filled chunks are handed to one background writer thread that
+ * passes them to the stream's sink (stdout by default), so the simulation
+ * loop never blocks on stdio locking or write syscalls unless it gets a
+ * whole ring ahead of the disk.  Integers are formatted by hand.
+ *
+ * Setting LC2K_TRACE=stdio in the environment routes everything through
+ * plain stdio instead, which is how the old printf path is benchmarked.
+ *
+ * Simulators end with traceExit() rather than exit(), so a thread running
+ * one as a batch job can catch the exit with traceCatchExit() and carry on.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <setjmp.h>
+
+typedef void (*traceSinkType)(void *, const char *, size_t);
+typedef struct traceStruct traceType;
+
+void traceInit(void);
+traceType *traceCreate(traceSinkType, void *);
+void traceSelect(traceType *);
+void traceFinish(traceType *);
+void traceDestroy(traceType *);
+
+void traceStr(const char *);
+void traceChar(char);
+void traceInt(int);
+void tracePrintf(const char *, ...);
+
+void traceCatchExit(jmp_buf *);
+void traceExit(int);
+
+#endif
@@ -1,36 +1,152 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
+#include <time.h>
+
+#include "mcimage.h"
 
 #define MAXLINELENGTH 1000
+#define INITSYMBOLS 64 /* initial symbol table capacity, must be a power of 2 */
+#define POOLCHUNK 65536 /* bytes per label string pool chunk */
+
+#define BEQOPCODE 4
+
+/* Instruction formats; each decides which fields are packed into the word */
+enum formatType {
+    RTYPE, ITYPE, JTYPE, OTYPE, FILLFORMAT
+};
+
+typedef struct opcodeStruct {
+    char *name;
+    int opcode;
+    enum formatType format;
+} opcodeType;
+
+const opcodeType opcodeTable[] = {
+    { "add", 0, RTYPE },
+    { "nand", 1, RTYPE },
+    { "lw", 2, ITYPE },
+    { "sw", 3, ITYPE },
+    { "beq", BEQOPCODE, ITYPE },
+    { "jalr", 5, JTYPE },
+    { "halt", 6, OTYPE },
+    { "noop", 7, OTYPE },
+    { ".fill", 0, FILLFORMAT },
+};
+
+#define NUMOPCODES (int)(sizeof(opcodeTable) / sizeof(opcodeTable[0]))
+
+typedef struct symbolStruct {
+    char *name; /* interned label, NULL if the slot is empty */
+    unsigned int hash;
+    int address; /* -1 until the label has been defined */
+    int fixups; /* head of the chain of uses waiting on this label, -1 if none */
+} symbolType;
+
+typedef struct poolStruct {
+    struct poolStruct *next;
+    int used;
+    int size;
+    char text[];
+} poolType;
+
+typedef struct symbolTableStruct {
+    symbolType *slots;
+    int capacity;
+    int count;
+    poolType *pool;
+} symbolTableType;
+
+/*
+ * A use of a label that was not yet defined when its word was emitted.
+ *     FIXFILL: .fill word, patched with the label address
+ *     FIXOFFSET: lw/sw offset field, patched with the label address
+ *     FIXBRANCH: beq offset field, patched with the pc-relative distance
+ */
+enum fixupKind {
+    FIXFILL, FIXOFFSET, FIXBRANCH
+};
+
+typedef struct fixupStruct {
+    int address; /* word to patch */
+    enum fixupKind kind;
+    int next; /* next fixup waiting on the same label, -1 at the end */
+} fixupType;
+
+/* Assembled words, held in memory until the whole input has been read */
+typedef struct imageStruct {
+    int *words;
+    int count;
+    int capacity;
+    fixupType *fixups;
+    int numFixups;
+    int fixupCapacity;
+} imageType;
 
 int readAndParse(FILE *, char *, char *, char *, char *, char *);
 int isNumber(char *);
-void getBinary(int* output, int in, int start, int end);
-void getOpCode(int* output, char* in);
-int toDecimal(int* input);
+const opcodeType *findOpcode(char *);
+int encodeInstruction(const opcodeType *, int, int, int, int);
+
+unsigned int hashLabel(char *);
+char *internLabel(symbolTableType *, char *);
+symbolType *probeSymbol(symbolTableType *, char *, unsigned int);
+void growSymbols(symbolTableType *);
+void initSymbols(symbolTableType *);
+void freeSymbols(symbolTableType *);
+symbolType *lookupSymbol(symbolTableType *, char *);
+
+void emitWord(imageType *, int);
+void addFixup(imageType *, symbolType *, enum fixupKind);
+void patchWord(imageType *, fixupType *, int);
+void defineLabel(symbolTableType *, imageType *, char *);
+int resolveLabel(symbolTableType *, imageType *, char *, enum fixupKind);
+void flushImage(imageType *, FILE *, int);
 
 int main(int argc, char *argv[]) {
     char *inFileString, *outFileString;
     FILE *inFilePtr, *outFilePtr;
     char label[MAXLINELENGTH], opcode[MAXLINELENGTH], arg0[MAXLINELENGTH], arg1[MAXLINELENGTH], arg2[MAXLINELENGTH];
-    char labels[50][MAXLINELENGTH];
+    symbolTableType symbols;
+    imageType image;
+    int reportStats = 0, binaryOutput = 0;
+    struct timespec startTime, endTime;
+    char *progName = argv[0];
+
+    /* -s reports assembly throughput on stderr, -b writes a binary image */
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if (strcmp(argv[1], "-s")==0)
+            reportStats = 1;
+        else if (strcmp(argv[1], "-b")==0)
+            binaryOutput = 1;
+        else
+            break;
+        argv++;
+        argc--;
+    }
 
     if (argc != 3) {
-        printf("error: usage: %s <assembly-code-file> <machine-code-file>\n", argv[0]);
+        printf("error: usage: %s [-s] [-b] <assembly-code-file> <machine-code-file>\n", progName);
+        printf("       either file may be - for stdin/stdout\n");
         exit(1);
     }
 
     inFileString = argv[1];
     outFileString = argv[2];
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
 
-    inFilePtr = fopen(inFileString, "r");
+    if (strcmp(inFileString, "-")==0)
+        inFilePtr = stdin;
+    else
+        inFilePtr = fopen(inFileString, "r");
     if (inFilePtr == NULL) {
         printf("error in opening %s\n", inFileString);
         exit(1);
     }
-    outFilePtr = fopen(outFileString, "w");
+    if (strcmp(outFileString, "-")==0)
+        outFilePtr = stdout;
+    else
+        outFilePtr = fopen(outFileString, "w");
     if (outFilePtr == NULL) {
         printf("error in opening %s\n", outFileString);
         exit(1);
@@ -40,118 +156,70 @@ int main(int argc, char *argv[]) {
     //  My code below                                                       //
     ////////////////////////////////////////////////////////////////////////*/
 
-    /* Go through and store all of the labels */
-    int counter = 0;
-    while (readAndParse(inFilePtr, label, opcode, arg0, arg1, arg2)==1) {
-
-        /* Check for duplicate labels */
-        int i;
-        for (i=0; i<counter; i++) {
-            if (strcmp(label, "") && strcmp(labels[i],label)==0) {
-                printf("Error! Duplicate label!\n");
-                exit(1);
-            }
-        }
-
-        strcpy(labels[counter],label);
-        counter++;
-    }
-    int total_labels = counter;
-    
-    /* Iterate through again to actually convert to binary/decimal
-        Change the labels to actual address this time through */
-    rewind(inFilePtr);
-    int pc = 0;
+    /* Assemble in a single pass.  Uses of labels that are not defined yet
+        are recorded as fixups and patched as soon as the label shows up */
+    initSymbols(&symbols);
+    memset(&image, 0, sizeof(image));
     while (readAndParse(inFilePtr, label, opcode, arg0, arg1, arg2)==1) {
 
-        /* Initialize the output array and set all elements to 0 to start */
-        int output[32];
-        int i;
-        for (i=0; i<31; i++)
-            output[i] = 0;
-
-        /* Get the opcode and place into bits 24-22 (inclusive) */
-        getOpCode(output, opcode);
+        if (strcmp(label, ""))
+            defineLabel(&symbols, &image, label);
 
-        /* Check for the different types of instruction formats */
-        /* R type */
-        if (output[24]==0 & output[23]==0) {
-
-            /* Convert the registers and offsets to binary and place them into the array */
-            getBinary(output, atoi(arg0), 19, 21);
-            getBinary(output, atoi(arg1), 16, 18);
-            getBinary(output, atoi(arg2), 0 ,2);
+        const opcodeType *op = findOpcode(opcode);
+        if (op == NULL) {
+            printf("Error! Invalid opcode!\n");
+            exit(1);
+        }
 
-        /* I type */
-        } else if ((output[24]==0 & output[23]==1 & output[22]==0) ||
-                    (output[24]==0 & output[23]==1 & output[22]==1) ||
-                    (output[24]==1 & output[23]==0 & output[22]==0))   {
+        /* .fill emits its value (or the address of its label) unchanged */
+        if (op->format == FILLFORMAT) {
+            if (isNumber(arg0)!=1)
+                emitWord(&image, resolveLabel(&symbols, &image, arg0, FIXFILL));
+            else
+                emitWord(&image, atoi(arg0));
+            continue;
+        }
 
-            /* Replace a label with corresponding address. If not, grab the offset */
-            int offset;
+        /* I type: replace a label with its address (pc-relative for beq) */
+        int offset = 0;
+        if (op->format == ITYPE) {
             if (isNumber(arg2)!=1) {
-                counter = 0;
-                while (counter<total_labels && strcmp(labels[counter],arg2)!=0)
-                    counter++;
-                if (counter>=total_labels) {
-                    printf("Error! Undefined label!\n");
-                    exit(1);
-                }
-                if (output[24]==1 & output[23]==0 & output[22]==0)
-                    offset = counter - pc - 1;
-                else
-                    offset = counter;
+                offset = resolveLabel(&symbols, &image, arg2,
+                    op->opcode == BEQOPCODE ? FIXBRANCH : FIXOFFSET);
             } else {
-
                 /* Check if the offset is greater/less than 2^16 */
                 offset = atoi(arg2);
                 if (offset<-32768 || offset>32767) {
                     printf("Error! Large offset!\n");
                     exit(1);
                 }
-
             }
-
-            /* Convert the registers and offsets to binary and place them into the array */
-            int regA = atoi(arg0), regB = atoi(arg1);
-            getBinary(output, regA, 19, 21);
-            getBinary(output, regB, 16, 18);
-            getBinary(output, offset, 0 ,15);
-
-        /* J type */
-        } else if (output[24]==1 & output[23]==0 & output[22]==1) {
-
-            /* Convert the registers and offsets to binary and place them into the array */
-            getBinary(output, atoi(arg0), 19, 21);
-            getBinary(output, atoi(arg1), 16, 18);
-
-        } 
-        /* Do nothing for O and .fill commands */
-
-        /* Converting the binary number back to decimal 
-            For .fill commands, just use the original number */
-        if (strcmp(opcode,".fill")==0) {
-
-            /* Figure out if the value for .fill is a label or not */
-            int offset = 0;
-            if (isNumber(arg0)!=1) {
-                int counter = 0;
-                while (strcmp(labels[counter],arg0)!=0)
-                    counter++;
-                offset = counter;
-            } else
-                offset = atoi(arg0);
-            fprintf(outFilePtr, "%d\n",offset);
-
-        /* For any other opcode command, convert the binary number */
-        } else {
-            int result = toDecimal(output);
-            fprintf(outFilePtr, "%d\n",result);
         }
 
-        pc++;
+        emitWord(&image, encodeInstruction(op, atoi(arg0), atoi(arg1), atoi(arg2), offset));
+    }
+
+    /* Any label still waiting on a definition was never defined */
+    int i;
+    for (i=0; i<symbols.capacity; i++) {
+        if (symbols.slots[i].name != NULL && symbols.slots[i].address < 0) {
+            printf("Error! Undefined label!\n");
+            exit(1);
+        }
     }
 
+    flushImage(&image, outFilePtr, binaryOutput);
+    int pc = image.count;
+    free(image.words);
+    free(image.fixups);
+    freeSymbols(&symbols);
+    fclose(outFilePtr);
+
+    if (reportStats) {
+        clock_gettime(CLOCK_MONOTONIC, &endTime);
+        double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+        fprintf(stderr, "assembled %d lines in %.3f s (%.0f lines/sec)\n", pc, seconds, seconds > 0 ? pc / seconds : 0.0);
+    }
     return(0);
 }
 
@@ -210,89 +278,250 @@ int isNumber(char *string) {
     return( (sscanf(string, "%d", &i)) == 1);
 }
 
-/**
-* Converts a decimal number to a binary number of length 3
-* @param: output is an integer array of size 16
-* @param: in is an input signed number
-*/
-void getBinary(int* output, int in, int start, int end) {
+/*
+ * Return the opcode table entry for mnemonic name, or NULL if there is none.
+ */
+const opcodeType *findOpcode(char *name) {
+    int i;
+    for (i=0; i<NUMOPCODES; i++) {
+        if (strcmp(opcodeTable[i].name, name)==0)
+            return &opcodeTable[i];
+    }
+    return NULL;
+}
+
+/*
+ * Pack one instruction word.  Opcode goes in bits 24-22, regA in 21-19,
+ * regB in 18-16; R type puts destReg in bits 2-0 and I type puts the 16-bit
+ * two's complement offset in bits 15-0.
+ */
+int encodeInstruction(const opcodeType *op, int regA, int regB, int destReg, int offset) {
+    unsigned int word = (unsigned int)op->opcode << 22;
+    if (op->format == OTYPE)
+        return word;
+    word |= (regA & 0x7) << 19 | (regB & 0x7) << 16;
+    if (op->format == RTYPE)
+        word |= destReg & 0x7;
+    else if (op->format == ITYPE)
+        word |= offset & 0xFFFF;
+    return word;
+}
+
+/*
+ * Symbol table: open addressing with linear probing over a power of 2 sized
+ * slot array, grown once it is half full.  Label strings are interned into
+ * a chunked pool so each one costs a single copy and no per-label malloc.
+ */
+unsigned int hashLabel(char *name) {
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void initSymbols(symbolTableType *table) {
+    table->capacity = INITSYMBOLS;
+    table->count = 0;
+    table->pool = NULL;
+    table->slots = calloc(table->capacity, sizeof(symbolType));
+    if (table->slots == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+}
+
+void freeSymbols(symbolTableType *table) {
+    while (table->pool != NULL) {
+        poolType *next = table->pool->next;
+        free(table->pool);
+        table->pool = next;
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = table->count = 0;
+}
+
+/*
+ * Copy name into the string pool and return the interned copy.
+ */
+char *internLabel(symbolTableType *table, char *name) {
+    int len = strlen(name) + 1;
+    poolType *pool = table->pool;
+    if (pool == NULL || pool->size - pool->used < len) {
+        int size = (len > POOLCHUNK) ? len : POOLCHUNK;
+        pool = malloc(sizeof(poolType) + size);
+        if (pool == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+        pool->next = table->pool;
+        pool->used = 0;
+        pool->size = size;
+        table->pool = pool;
+    }
+    char *copy = pool->text + pool->used;
+    memcpy(copy, name, len);
+    pool->used += len;
+    return copy;
+}
+
+/*
+ * Return the slot holding name, or the empty slot where it belongs.
+ */
+symbolType *probeSymbol(symbolTableType *table, char *name, unsigned int hash) {
+    int mask = table->capacity - 1;
+    int i = hash & mask;
+    while (table->slots[i].name != NULL) {
+        if (table->slots[i].hash == hash && strcmp(table->slots[i].name, name)==0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
 
-    /* Store either all 1s or all 0s depending on the sign of the input number */
+void growSymbols(symbolTableType *table) {
+    symbolType *old = table->slots;
+    int oldCapacity = table->capacity;
+    table->capacity *= 2;
+    table->slots = calloc(table->capacity, sizeof(symbolType));
+    if (table->slots == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
     int i;
-    for (i=start; i<=end; i++) {
-        if (in<0)
-            output[i] = 1;
+    for (i=0; i<oldCapacity; i++) {
+        if (old[i].name != NULL)
+            *probeSymbol(table, old[i].name, old[i].hash) = old[i];
     }
+    free(old);
+}
 
-    /* Figure out how much of the 16 bits will be used for the number */
-    int bit_len;
-	if (in<0) bit_len = ceil(log10(-1*in)/log10(2))+1;
-	else bit_len = ceil(log10(in+1)/log10(2));
-	
-    /* Iterate through to calculate the binary number as an unsigned int */
-    int total = abs(in);
-	for (i=bit_len-1+start; i>=start; i--) {
-		if (pow(2,i-start)<=total) {
-            output[i] = 1;
-			total -= pow(2,i-start);
-		} else
-            output[i] = 0;
-	}
-
-    /* If the number needs to be a negative, convert to 2s complement by flipping bits and adding 1 */
-	if (in<0) {
-		int carry = 1;
-		for (i=start; i<bit_len; i++) {
-			if (output[i]) {
-				output[i] = carry;
-				carry = 0;
-			} else
-				output[i] = !carry;
-		}
-	}
+/*
+ * Return the symbol for label name, adding it as undefined if it is new.
+ */
+symbolType *lookupSymbol(symbolTableType *table, char *name) {
+    unsigned int hash = hashLabel(name);
+    symbolType *slot = probeSymbol(table, name, hash);
+    if (slot->name != NULL)
+        return slot;
+    if (2 * (table->count + 1) > table->capacity) {
+        growSymbols(table);
+        slot = probeSymbol(table, name, hash);
+    }
+    slot->name = internLabel(table, name);
+    slot->hash = hash;
+    slot->address = -1;
+    slot->fixups = -1;
+    table->count++;
+    return slot;
 }
 
-/**
-* Converts the opcode to a binary representation
-* @param: in is a string representing the opcode
-* @return: string of length 3 of the opcode's binary representation
-*/
-void getOpCode(int* o, char* in) {
-    int s = 24;
-	if (strcmp(in,"add")==0) {
-        o[s-0] = o[s-1] = o[s-2] = 0;
-    } else if (strcmp(in,"nand")==0) {
-		o[s-0] = o[s-1] = 0;
-        o[s-2] = 1;
-	} else if (strcmp(in,"lw")==0) {
-        o[s-0] = o[s-2] = 0;
-        o[s-1] = 1;
-    } else if (strcmp(in,"sw")==0) {
-        o[s-0] = 0;
-        o[s-1] = o[s-2] = 1;
-    } else if (strcmp(in,"beq")==0) {
-        o[s-0] = 1;
-        o[s-1] = o[s-2] = 0;
-    } else if (strcmp(in,"jalr")==0) {
-        o[s-0] = o[s-2] = 1;
-        o[s-1] = 0;
-    } else if (strcmp(in,"halt")==0) {
-        o[s-0] = o[s-1] = 1;
-        o[s-2] = 0;
-    } else if (strcmp(in,"noop")==0) {
-        o[s-0] = o[s-1] = o[s-2] = 1;
-    } else if (strcmp(in,".fill")==0) {
-        /* Do nothing - will be fixed in the next function */
-    } else {
-        printf("Error! Invalid opcode!\n");
-		exit(1);
+/*
+ * Append one word to the in-memory image.
+ */
+void emitWord(imageType *image, int word) {
+    if (image->count == image->capacity) {
+        image->capacity = image->capacity ? 2 * image->capacity : 1024;
+        image->words = realloc(image->words, image->capacity * sizeof(int));
+        if (image->words == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+    }
+    image->words[image->count++] = word;
+}
+
+/*
+ * Remember that the word about to be emitted uses the undefined label sym.
+ */
+void addFixup(imageType *image, symbolType *sym, enum fixupKind kind) {
+    if (image->numFixups == image->fixupCapacity) {
+        image->fixupCapacity = image->fixupCapacity ? 2 * image->fixupCapacity : 256;
+        image->fixups = realloc(image->fixups, image->fixupCapacity * sizeof(fixupType));
+        if (image->fixups == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+    }
+    fixupType *fixup = &image->fixups[image->numFixups];
+    fixup->address = image->count;
+    fixup->kind = kind;
+    fixup->next = sym->fixups;
+    sym->fixups = image->numFixups++;
+}
+
+/*
+ * Fill in the label value for one fixup now that the label is known.
+ */
+void patchWord(imageType *image, fixupType *fixup, int labelAddress) {
+    if (fixup->kind == FIXFILL) {
+        image->words[fixup->address] = labelAddress;
+        return;
     }
+    int offset = labelAddress;
+    if (fixup->kind == FIXBRANCH)
+        offset = labelAddress - fixup->address - 1;
+    if (offset<-32768 || offset>32767) {
+        printf("Error! Large offset!\n");
+        exit(1);
+    }
+    image->words[fixup->address] |= offset & 0xFFFF;
 }
 
-int toDecimal(int* input) {
+/*
+ * Define label at the current address and patch every use waiting on it.
+ */
+void defineLabel(symbolTableType *table, imageType *image, char *label) {
+    symbolType *sym = lookupSymbol(table, label);
+    if (sym->address >= 0) {
+        printf("Error! Duplicate label!\n");
+        exit(1);
+    }
+    sym->address = image->count;
     int i;
-    int sum = 0;
-    for (i=0;i<32; i++)
-        sum += input[i]*pow(2,i);
-    return sum;
-}
\ No newline at end of file
+    for (i=sym->fixups; i>=0; i=image->fixups[i].next)
+        patchWord(image, &image->fixups[i], sym->address);
+    sym->fixups = -1;
+}
+
+/*
+ * Return the value label contributes to the word about to be emitted: its
+ * address, or its distance for a branch.  Labels that are not defined yet
+ * contribute 0 and get a fixup instead.
+ */
+int resolveLabel(symbolTableType *table, imageType *image, char *label, enum fixupKind kind) {
+    symbolType *sym = lookupSymbol(table, label);
+    if (sym->address < 0) {
+        addFixup(image, sym, kind);
+        return 0;
+    }
+    int value = sym->address;
+    if (kind == FIXBRANCH)
+        value = sym->address - image->count - 1;
+    if (kind != FIXFILL && (value<-32768 || value>32767)) {
+        printf("Error! Large offset!\n");
+        exit(1);
+    }
+    return value;
+}
+
+/*
+ * Write the finished image as machine code: one decimal word per line, or
+ * a binary image (see mcimage.h) when binary is set.
+ */
+void flushImage(imageType *image, FILE *outFilePtr, int binary) {
+    if (binary) {
+        if (!writeImage(outFilePtr, image->words, image->count, 0)) {
+            printf("error: could not write machine code\n");
+            exit(1);
+        }
+    } else {
+        int i;
+        for (i=0; i<image->count; i++)
+            fprintf(outFilePtr, "%d\n", image->words[i]);
+    }
+    fflush(outFilePtr);
+}
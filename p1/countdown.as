@@ -0,0 +1,9 @@
+	lw	0	1	count	load loop counter
+	lw	0	2	neg1
+loop	add	1	2	1	count down
+	sw	0	1	count	keep memory changing every iteration
+	beq	0	1	done
+	beq	0	0	loop
+done	halt
+count	.fill	200000
+neg1	.fill	-1
@@ -0,0 +1,134 @@
+/*
+ * Expand a delta trace from "simulate -d" back into the full output the
+ * simulator prints without -d, so it can be compared against golden files.
+ *
+ * usage: expandtrace [delta-trace-file]   (reads stdin without a file)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUMMEMORY 65536 /* maximum number of words in memory */
+#define NUMREGS 8 /* number of machine registers */
+#define MAXLINELENGTH 1000
+
+typedef struct stateStruct {
+    int pc;
+    int mem[NUMMEMORY];
+    int reg[NUMREGS];
+    int numMemory;
+} stateType;
+
+void printState(stateType *);
+int readWord(FILE *);
+void badTrace(char *);
+
+int main(int argc, char *argv[]) {
+    char line[MAXLINELENGTH];
+    stateType state;
+    FILE *filePtr = stdin;
+    int version, i;
+
+    if (argc > 2) {
+        printf("error: usage: %s [delta-trace-file]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2) {
+        filePtr = fopen(argv[1], "r");
+        if (filePtr == NULL) {
+            printf("error: can't open file %s\n", argv[1]);
+            perror("fopen");
+            exit(1);
+        }
+    }
+
+    memset(&state, 0, sizeof(state));
+    if (fgets(line, MAXLINELENGTH, filePtr) == NULL ||
+            sscanf(line, "lc2k-delta %d %d", &version, &state.numMemory) != 2 ||
+            version != 1 || state.numMemory < 0 || state.numMemory > NUMMEMORY)
+        badTrace("missing lc2k-delta header");
+
+    for (i=0; i<state.numMemory; i++) {
+        state.mem[i] = readWord(filePtr);
+        printf("memory[%d]=%d\n", i, state.mem[i]);
+    }
+
+    while (fgets(line, MAXLINELENGTH, filePtr) != NULL) {
+        char *ptr = line;
+
+        if (line[0] == 'S') {
+            /* full snapshot: resynchronize everything */
+            ptr++;
+            state.pc = strtol(ptr, &ptr, 10);
+            for (i=0; i<NUMREGS; i++)
+                state.reg[i] = strtol(ptr, &ptr, 10);
+            if (fgets(line, MAXLINELENGTH, filePtr) == NULL ||
+                    sscanf(line, "M %d", &state.numMemory) != 1 ||
+                    state.numMemory < 0 || state.numMemory > NUMMEMORY)
+                badTrace("snapshot without memory");
+            for (i=0; i<state.numMemory; i++)
+                state.mem[i] = readWord(filePtr);
+            continue;
+        }
+
+        if (line[0] == 'H') {
+            int count;
+            if (sscanf(line, "H %d %d", &state.pc, &count) != 2)
+                badTrace("bad halt line");
+            printState(&state);
+            state.pc++;
+            printf("machine halted\ntotal of %d instructions executed\nfinal state of machine:\n", count);
+            printState(&state);
+            return(0);
+        }
+
+        /* one executed instruction: print the state before it, then apply it */
+        state.pc = strtol(ptr, &ptr, 10);
+        printState(&state);
+        while (*ptr == ' ')
+            ptr++;
+        if (*ptr == 'r') {
+            int regNum = strtol(ptr + 1, &ptr, 10);
+            if (regNum < 0 || regNum >= NUMREGS)
+                badTrace("bad register");
+            state.reg[regNum] = strtol(ptr, &ptr, 10);
+        } else if (*ptr == 'm') {
+            int addr = strtol(ptr + 1, &ptr, 10);
+            if (addr < 0 || addr >= NUMMEMORY)
+                badTrace("bad address");
+            state.mem[addr] = strtol(ptr, &ptr, 10);
+        }
+    }
+
+    badTrace("trace ends before the machine halted");
+    return(1);
+}
+
+int readWord(FILE *filePtr) {
+    char line[MAXLINELENGTH];
+    int word;
+    if (fgets(line, MAXLINELENGTH, filePtr) == NULL || sscanf(line, "%d", &word) != 1)
+        badTrace("truncated memory image");
+    return word;
+}
+
+void badTrace(char *message) {
+    printf("error: bad delta trace: %s\n", message);
+    exit(1);
+}
+
+void printState(stateType *statePtr) {
+    int i;
+    printf("\n@@@\nstate:\n");
+    printf("\tpc %d\n", statePtr->pc);
+    printf("\tmemory:\n");
+    for (i=0; i<statePtr->numMemory; i++) {
+        printf("\t\tmem[ %d ] %d\n", i, statePtr->mem[i]);
+    }
+    printf("\tregisters:\n");
+    for (i=0; i<NUMREGS; i++) {
+        printf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
+    }
+    printf("end state\n");
+}
@@ -0,0 +1,90 @@
+/*
+ * Synthetic LC-2K program generator for assembler benchmarks.
+ *
+ * Writes an assembly program of exactly <words> lines to stdout: a jump over
+ * a block of .fill data, then a mix of every opcode with labels on every
+ * fourth line and both forward and backward symbolic references.  The
+ * program is not meant to be run, only assembled.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define LABELEVERY 4 /* one code label per this many instructions */
+#define BRANCHWINDOW 256 /* beq targets stay within this many labels */
+
+unsigned int seed = 370;
+
+/* small deterministic LCG so every run produces the same program */
+unsigned int nextRandom(void) {
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 16) & 0x7fff;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 || atoi(argv[1]) < 3) {
+        printf("error: usage: %s <words>\n", argv[0]);
+        exit(1);
+    }
+
+    int words = atoi(argv[1]);
+    int numData = words / 8;
+    /* keep lw/sw label addresses inside the signed 16-bit offset field */
+    if (numData > 30000)
+        numData = 30000;
+    int numCode = words - numData - 1;
+    int numLabels = (numCode + LABELEVERY - 1) / LABELEVERY;
+    int i;
+
+    printf("\tbeq\t0\t0\tL0\tskip the data block\n");
+    for (i=0; i<numData; i++) {
+        if (i % 3 == 0)
+            printf("D%d\t.fill\tL%d\n", i, nextRandom() % numLabels);
+        else
+            printf("D%d\t.fill\t%d\n", i, (int)nextRandom() - 16384);
+    }
+
+    for (i=0; i<numCode; i++) {
+        if (i % LABELEVERY == 0)
+            printf("L%d", i / LABELEVERY);
+
+        if (i == numCode - 1) {
+            printf("\thalt\n");
+            continue;
+        }
+
+        int regA = nextRandom() % 8, regB = nextRandom() % 8;
+        int target;
+        switch (nextRandom() % 8) {
+        case 0:
+        case 1:
+            printf("\tadd\t%d\t%d\t%d\n", regA, regB, nextRandom() % 8);
+            break;
+        case 2:
+            printf("\tnand\t%d\t%d\t%d\n", regA, regB, nextRandom() % 8);
+            break;
+        case 3:
+            printf("\tlw\t%d\t%d\tD%d\n", regA, regB, nextRandom() % numData);
+            break;
+        case 4:
+            printf("\tsw\t%d\t%d\tD%d\n", regA, regB, nextRandom() % numData);
+            break;
+        case 5:
+            target = i / LABELEVERY + (int)(nextRandom() % (2 * BRANCHWINDOW)) - BRANCHWINDOW;
+            if (target < 0)
+                target = 0;
+            if (target >= numLabels)
+                target = numLabels - 1;
+            printf("\tbeq\t%d\t%d\tL%d\n", regA, regB, target);
+            break;
+        case 6:
+            printf("\tjalr\t%d\t%d\n", regA, regB);
+            break;
+        default:
+            printf("\tnoop\n");
+            break;
+        }
+    }
+
+    return(0);
+}
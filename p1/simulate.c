@@ -3,197 +3,929 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
+#include <time.h>
+
+#include "mcimage.h"
+#include "trace.h"
 
 #define NUMMEMORY 65536 /* maximum number of words in memory */
 #define NUMREGS 8 /* number of machine registers */
 #define MAXLINELENGTH 1000
 
+#define ADD 0
+#define NAND 1
+#define LW 2
+#define SW 3
+#define BEQ 4
+#define JALR 5
+#define HALT 6
+#define NOOP 7
+#define UNDECODED -1 /* decode cache entry not filled in yet */
+
+#define TRACEFULL 0 /* print the whole state before every instruction */
+#define TRACEDELTA 1 /* print only what each instruction changed */
+
+/* One predecoded memory word */
+typedef struct commandStruct {
+    signed char opcode;
+    unsigned char regA;
+    unsigned char regB;
+    unsigned char dest;
+    int offset; /* sign-extended */
+} command;
+
 typedef struct stateStruct {
     int pc;
     int mem[NUMMEMORY];
     int reg[NUMREGS];
     int numMemory;
+    command decoded[NUMMEMORY]; /* decode cache, one entry per memory word */
+    int highestStore; /* highest address written by sw, -1 if none */
+    struct jitStruct *jit; /* translation cache, NULL until the JIT runs */
+    int traceMode;
+    int snapshotInterval; /* delta traces: steps between full snapshots, 0 for none */
+    long long steps; /* instructions traced so far */
+    int pendingPc; /* delta traces: instruction whose effects are not printed yet, -1 if none */
+    command pendingCommand;
+    int pendingAddress;
 } stateType;
 
-typedef struct commandStruct {
-    char* opcode;
-    int regA;
-    int regB;
-    int dest;
-    int offset;
-} command;
-
 void printState(stateType *);
-char* convertOpcode(int a, int b, int c);
-void convertDec(int* mem_bin, int sum);
+void traceStep(stateType *, command *);
+void traceSnapshot(stateType *);
+void tracePending(stateType *);
+command *fetchDecoded(stateType *, int);
+int checkAddress(int);
 int convertNum(int num);
+int runSwitch(stateType *, int);
+int runThreaded(stateType *, int);
+int runJit(stateType *, int);
+void jitFlush(struct jitStruct *);
+void jitInvalidate(struct jitStruct *, int);
+void jitDestroy(struct jitStruct *);
+void benchmark(stateType *, int);
+
+/*
+ * Execution engines.  Each runs from statePtr->pc until it reaches a halt,
+ * leaving pc on the halt, and returns the number of instructions executed
+ * before it.  With trace set traceStep() is called before every instruction.
+ */
+typedef int (*engineType)(stateType *, int);
+
+typedef struct engineStruct {
+    char *name;
+    engineType run;
+} engineEntry;
+
+engineEntry engines[] = {
+    { "switch", runSwitch },
+    { "threaded", runThreaded },
+    { "jit", runJit },
+};
+
+#define NUMENGINES (int)(sizeof(engines) / sizeof(engines[0]))
 
 int main(int argc, char *argv[]) {
-    char line[MAXLINELENGTH];
     stateType state;
     FILE *filePtr;
+    char *progName = argv[0];
+    engineEntry *engine = &engines[0];
+    int benchReps = 0;
+    int trace = 1;
+    int i;
+
+    traceInit();
+    state.traceMode = TRACEFULL;
+    state.snapshotInterval = 0;
+
+    /* -e picks the execution engine, -q prints only the final state, -d
+        prints a delta trace with a full snapshot every so many steps, -b
+        benchmarks every engine instead of tracing one run */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-q")==0) {
+            trace = 0;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 4)
+            break;
+        if (strcmp(argv[1], "-e")==0) {
+            for (i=0; i<NUMENGINES && strcmp(engines[i].name, argv[2]); i++)
+                ;
+            if (i == NUMENGINES) {
+                tracePrintf("error: unknown engine %s\n", argv[2]);
+                traceExit(1);
+            }
+            engine = &engines[i];
+        } else if (strcmp(argv[1], "-b")==0) {
+            benchReps = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-d")==0) {
+            state.traceMode = TRACEDELTA;
+            state.snapshotInterval = atoi(argv[2]);
+        } else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
 
     if (argc != 2) {
-        printf("error: usage: %s <machine-code file>\n", argv[0]);
-        exit(1);
+        tracePrintf("error: usage: %s [-e switch|threaded|jit] [-q | -d snapshotInterval] [-b repetitions] <machine-code file>\n", progName);
+        traceExit(1);
     }
 
     filePtr = fopen(argv[1], "r");
     if (filePtr == NULL) {
-        printf("error: can't open file %s", argv[1]);
+        tracePrintf("error: can't open file %s", argv[1]);
         perror("fopen");
-        exit(1);
+        traceExit(1);
     }
 
     /*/////////////////////////////////////////////////////////////////////////
     // MY CODE BELOW                                                         //
     /////////////////////////////////////////////////////////////////////////*/
 
-    /* read in the entire machine-code file into memory */
-    for (state.numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL;
-            state.numMemory++) {
+    /* read in the entire machine-code file (text or binary) into memory;
+        words past the end of the program read as 0 */
+    memset(state.mem, 0, sizeof(state.mem));
+    int entry;
+    state.numMemory = loadImage(filePtr, state.mem, NUMMEMORY, &entry);
+    fclose(filePtr);
+    if (state.numMemory < 0)
+        traceExit(1);
+
+    /* Initialize program counter to the entry point and registers to 0 */
+    state.pc = entry;
+    state.highestStore = -1;
+    state.jit = NULL;
+    for (i=0; i<NUMREGS; i++)
+        state.reg[i] = 0;
+
+    /* Words are decoded the first time they are executed */
+    for (i=0; i<NUMMEMORY; i++)
+        state.decoded[i].opcode = UNDECODED;
 
-        if (sscanf(line, "%d", state.mem+state.numMemory) != 1) {
-            printf("error in reading address %d\n", state.numMemory);
-            exit(1);
+    if (benchReps > 0) {
+        benchmark(&state, benchReps);
+        jitDestroy(state.jit);
+        return(0);
+    }
+
+    state.steps = 0;
+    state.pendingPc = -1;
+    if (trace && state.traceMode == TRACEDELTA) {
+        /* expandtrace rebuilds the usual output from this */
+        tracePrintf("lc2k-delta 1 %d\n", state.numMemory);
+        for (i=0; i<state.numMemory; i++) {
+            traceInt(state.mem[i]);
+            traceChar('\n');
         }
-        printf("memory[%d]=%d\n", state.numMemory, state.mem[state.numMemory]);
+        int execution = engine->run(&state, trace);
+        tracePending(&state);
+        tracePrintf("H %d %d\n", state.pc, execution+1);
+        jitDestroy(state.jit);
+        return(0);
     }
 
-    /* Initialize program counter and registerse to 0 */
-    state.pc = 0;
-    int i;
-    for (i=0; i<NUMREGS; i++)
-        state.reg[i] = 0;
+    for (i=0; i<state.numMemory; i++) {
+        traceStr("memory[");
+        traceInt(i);
+        traceStr("]=");
+        traceInt(state.mem[i]);
+        traceChar('\n');
+    }
+
+    int execution = engine->run(&state, trace);
+ 
+    /* Print out the new state */
+    if (trace)
+        printState(&state);
+    state.pc++;
+
+    tracePrintf("machine halted\ntotal of %d instructions executed\nfinal state of machine:\n", execution+1);
 
-    /* Initialize and convert the input memory into the 32 bit binary string */
-    int mem_bin[32];
-    convertDec(mem_bin, state.mem[state.pc]);
+    /* Print out the new state */
+    printState(&state);
 
+    jitDestroy(state.jit);
+    return(0);
+}
+
+/*
+ * Switch-dispatched engine: one loop, one indirect branch for every
+ * instruction.
+ */
+int runSwitch(stateType *statePtr, int trace) {
     int execution = 0;
 
-    char* opcode = convertOpcode(mem_bin[24], mem_bin[23], mem_bin[22]);
-    while (strcmp(opcode, "halt")!=0) {
+    command *cc = fetchDecoded(statePtr, statePtr->pc);
+    while (cc->opcode != HALT) {
 
         execution++;
 
         /* Print out the original state */
-        printState(&state);
+        if (trace)
+            traceStep(statePtr, cc);
+
+        switch (cc->opcode) {
+        case ADD:
+            statePtr->reg[cc->dest] = statePtr->reg[cc->regA] + statePtr->reg[cc->regB];
+            break;
+        case NAND:
+            statePtr->reg[cc->dest] = ~(statePtr->reg[cc->regA] & statePtr->reg[cc->regB]);
+            break;
+        case LW:
+            statePtr->reg[cc->regB] = statePtr->mem[checkAddress(statePtr->reg[cc->regA] + cc->offset)];
+            break;
+        case SW: {
+            int addr = checkAddress(statePtr->reg[cc->regA] + cc->offset);
+            statePtr->mem[addr] = statePtr->reg[cc->regB];
+            /* the stored word may be executed later; drop its stale decode */
+            statePtr->decoded[addr].opcode = UNDECODED;
+            if (addr > statePtr->highestStore)
+                statePtr->highestStore = addr;
+            break;
+        }
+        case BEQ:
+            if (statePtr->reg[cc->regA]==statePtr->reg[cc->regB])
+                statePtr->pc += cc->offset;
+            break;
+        case JALR:
+            statePtr->reg[cc->regB] = statePtr->pc + 1;
+            statePtr->pc = statePtr->reg[cc->regA] - 1;
+            break;
+        default: /* noop */
+            break;
+        }
+
+        statePtr->pc++;
+        cc = fetchDecoded(statePtr, statePtr->pc);
+    }
+
+    return execution;
+}
+
+/*
+ * Direct-threaded engine: every handler ends by fetching the next
+ * instruction and jumping straight to its handler, so each opcode gets its
+ * own indirect branch for the predictor to learn.  Needs GCC's labels as
+ * values; other compilers fall back to the switch engine.
+ */
+int runThreaded(stateType *statePtr, int trace) {
+#ifdef __GNUC__
+    static void *handlers[8] = {
+        &&doAdd, &&doNand, &&doLw, &&doSw, &&doBeq, &&doJalr, &&doHalt, &&doNoop
+    };
+    int execution = 0;
+    int *reg = statePtr->reg;
+    command *cc;
+
+#define BEGIN() do { \
+        execution++; \
+        if (trace) \
+            traceStep(statePtr, cc); \
+    } while (0)
+#define NEXT() do { \
+        statePtr->pc++; \
+        cc = fetchDecoded(statePtr, statePtr->pc); \
+        goto *handlers[cc->opcode]; \
+    } while (0)
+
+    cc = fetchDecoded(statePtr, statePtr->pc);
+    goto *handlers[cc->opcode];
+
+doAdd:
+    BEGIN();
+    reg[cc->dest] = reg[cc->regA] + reg[cc->regB];
+    NEXT();
+doNand:
+    BEGIN();
+    reg[cc->dest] = ~(reg[cc->regA] & reg[cc->regB]);
+    NEXT();
+doLw:
+    BEGIN();
+    reg[cc->regB] = statePtr->mem[checkAddress(reg[cc->regA] + cc->offset)];
+    NEXT();
+doSw:
+    BEGIN();
+    {
+        int addr = checkAddress(reg[cc->regA] + cc->offset);
+        statePtr->mem[addr] = reg[cc->regB];
+        statePtr->decoded[addr].opcode = UNDECODED;
+        if (addr > statePtr->highestStore)
+            statePtr->highestStore = addr;
+    }
+    NEXT();
+doBeq:
+    BEGIN();
+    if (reg[cc->regA]==reg[cc->regB])
+        statePtr->pc += cc->offset;
+    NEXT();
+doJalr:
+    BEGIN();
+    reg[cc->regB] = statePtr->pc + 1;
+    statePtr->pc = reg[cc->regA] - 1;
+    NEXT();
+doNoop:
+    BEGIN();
+    NEXT();
+doHalt:
+    return execution;
+
+#undef BEGIN
+#undef NEXT
+#else
+    return runSwitch(statePtr, trace);
+#endif
+}
+
+/*
+ * Run the loaded program reps times on every engine with tracing off and
+ * report millions of instructions per second.  Memory, registers and pc
+ * are restored before each run; only the runs themselves are timed.
+ */
+void benchmark(stateType *statePtr, int reps) {
+    int *initialMem = malloc(NUMMEMORY * sizeof(int));
+    if (initialMem == NULL) {
+        tracePrintf("error: out of memory\n");
+        traceExit(1);
+    }
+    memcpy(initialMem, statePtr->mem, NUMMEMORY * sizeof(int));
+    int entry = statePtr->pc;
+
+    int e, r, i;
+    for (e=0; e<NUMENGINES; e++) {
+        long long instructions = 0;
+        double seconds = 0;
+        for (r=0; r<reps; r++) {
+            /* only words up to the highest store can have changed */
+            int dirty = statePtr->numMemory;
+            if (statePtr->highestStore >= dirty)
+                dirty = statePtr->highestStore + 1;
+            for (i=0; i<dirty; i++) {
+                if (statePtr->mem[i] != initialMem[i]) {
+                    statePtr->mem[i] = initialMem[i];
+                    statePtr->decoded[i].opcode = UNDECODED;
+                    if (statePtr->jit != NULL)
+                        jitInvalidate(statePtr->jit, i);
+                }
+            }
+            for (i=0; i<NUMREGS; i++)
+                statePtr->reg[i] = 0;
+            statePtr->pc = entry;
+            statePtr->highestStore = -1;
+
+            struct timespec startTime, endTime;
+            clock_gettime(CLOCK_MONOTONIC, &startTime);
+            instructions += engines[e].run(statePtr, 0) + 1;
+            clock_gettime(CLOCK_MONOTONIC, &endTime);
+            seconds += (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+        }
+        tracePrintf("%-10s %lld instructions in %.3f s: %.1f MIPS\n", engines[e].name,
+            instructions, seconds, seconds > 0 ? instructions / seconds / 1e6 : 0.0);
+    }
+    free(initialMem);
+}
+
+/*
+ * Basic-block JIT to x86-64.
+ *
+ * A block runs from its entry pc up to and including the first beq, jalr
+ * or halt (or JITMAXBLOCK instructions).  The eight LC-2K registers live in
+ * r8d-r15d for as long as generated code runs; rbx points at the
+ * jitContextType, rdi at simulated memory and rsi at the code map, which
+ * flags every word some translation was built from.  A sw that hits a
+ * flagged word leaves generated code so the whole cache can be flushed.
+ *
+ * Every block exit goes through an exit site:
+ *     mov eax, nextPc ; mov edx, site ; jmp exitRoutine
+ * The driver patches the first five bytes of a site into a direct jmp to
+ * the target block once that block exists, so hot paths stay in generated
+ * code.  Exits that cannot be chained pass a negative site (JITEXIT*).
+ */
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JITCODESIZE (16 << 20) /* bytes of executable code buffer */
+#define JITMAXBLOCK 64 /* instructions per block */
+#define JITMAXBLOCKBYTES (JITMAXBLOCK * 64 + 64) /* worst case block size */
+#define JITEXITDYNAMIC -1 /* jalr: target known only at run time */
+#define JITEXITHALT -2
+#define JITEXITSMC -3 /* store into translated code */
+#define JITEXITFAULT -4 /* load/store address out of range */
+
+/* Shared with generated code, which addresses the fields through rbx */
+typedef struct jitContextStruct {
+    long long count; /* instructions executed, halt included */
+    int reg[NUMREGS];
+    int *mem;
+    unsigned char *codeMap;
+    int exitSite;
+    int highestStore;
+} jitContextType;
+
+typedef struct jitSiteStruct {
+    int offset; /* code offset of the exit site */
+    int target; /* pc the site leaves for */
+} jitSiteType;
+
+typedef struct jitBlockStruct {
+    int pc;
+    int length;
+} jitBlockType;
+
+typedef struct jitStruct {
+    jitContextType ctx;
+    unsigned char *code;
+    int codeUsed;
+    int flushMark; /* codeUsed just past the trampoline and exit routine */
+    int exitRoutine;
+    int generation; /* bumped by every flush */
+    int blockAt[NUMMEMORY]; /* code offset of the block starting at a pc, -1 if none */
+    unsigned char codeMap[NUMMEMORY];
+    jitSiteType *sites;
+    int numSites;
+    int siteCapacity;
+    jitBlockType blocks[NUMMEMORY]; /* every block translated since the last flush */
+    int numBlocks;
+} jitType;
+
+#define CTXOFFSET(field) (int)offsetof(jitContextType, field)
+
+void emitByte(jitType *jit, int byte) {
+    jit->code[jit->codeUsed++] = byte;
+}
+
+void emitInt(jitType *jit, int value) {
+    memcpy(jit->code + jit->codeUsed, &value, 4);
+    jit->codeUsed += 4;
+}
+
+/* op r/m32, r32 with both operands host registers 0-15 */
+void emitRegReg(jitType *jit, int op, int reg, int rm) {
+    if (reg >= 8 || rm >= 8)
+        emitByte(jit, 0x40 | (reg >= 8) << 2 | (rm >= 8));
+    emitByte(jit, op);
+    emitByte(jit, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* mov eax, imm ; mov edx, site ; jmp exitRoutine */
+void emitExit(jitType *jit, int pc, int site) {
+    emitByte(jit, 0xB8);
+    emitInt(jit, pc);
+    emitByte(jit, 0xBA);
+    emitInt(jit, site);
+    emitByte(jit, 0xE9);
+    emitInt(jit, jit->exitRoutine - (jit->codeUsed + 4));
+}
+
+/* a chainable exit to target */
+void emitSite(jitType *jit, int target) {
+    if (jit->numSites == jit->siteCapacity) {
+        jit->siteCapacity = jit->siteCapacity ? 2 * jit->siteCapacity : 1024;
+        jit->sites = realloc(jit->sites, jit->siteCapacity * sizeof(jitSiteType));
+        if (jit->sites == NULL) {
+            tracePrintf("error: out of memory\n");
+            traceExit(1);
+        }
+    }
+    jit->sites[jit->numSites].offset = jit->codeUsed;
+    jit->sites[jit->numSites].target = target;
+    emitExit(jit, target, jit->numSites);
+    jit->numSites++;
+}
+
+/* Leave in the middle of a block, giving back the instructions not run */
+void emitEarlyExit(jitType *jit, int pc, int reason, int unexecuted) {
+    /* sub qword [rbx], unexecuted */
+    emitByte(jit, 0x48);
+    emitByte(jit, 0x81);
+    emitByte(jit, 0x2B);
+    emitInt(jit, unexecuted);
+    emitExit(jit, pc, reason);
+}
+
+#define EARLYEXITBYTES 22
+
+/* eax = reg[regA] + offset, leaving through a fault exit if out of range */
+void emitAddress(jitType *jit, command *cc, int pc, int unexecuted) {
+    emitRegReg(jit, 0x89, 8 + cc->regA, 0); /* mov eax, regA */
+    emitByte(jit, 0x05); /* add eax, offset */
+    emitInt(jit, cc->offset);
+    emitByte(jit, 0x3D); /* cmp eax, NUMMEMORY */
+    emitInt(jit, NUMMEMORY);
+    emitByte(jit, 0x72); /* jb past the fault exit */
+    emitByte(jit, EARLYEXITBYTES);
+    emitEarlyExit(jit, pc, JITEXITFAULT, unexecuted);
+}
+
+/*
+ * Generated once per code buffer: the entry trampoline at offset 0,
+ *     int enter(jitContextType *ctx, void *block)
+ * and the common exit routine that returns the next pc.
+ */
+void emitRuntime(jitType *jit) {
+    static const unsigned char pushes[] = { 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 };
+    static const unsigned char pops[] = { 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B };
+    int i;
 
-        /* Insert the correct opcode into the command struct */
+    jit->codeUsed = 0;
+    for (i=0; i<(int)sizeof(pushes); i++)
+        emitByte(jit, pushes[i]);
+    emitByte(jit, 0x48); emitByte(jit, 0x89); emitByte(jit, 0xFB); /* mov rbx, rdi */
+    emitByte(jit, 0x48); emitByte(jit, 0x89); emitByte(jit, 0xF0); /* mov rax, rsi */
+    emitByte(jit, 0x48); emitByte(jit, 0x8B); emitByte(jit, 0x7B); /* mov rdi, [rbx+mem] */
+    emitByte(jit, CTXOFFSET(mem));
+    emitByte(jit, 0x48); emitByte(jit, 0x8B); emitByte(jit, 0x73); /* mov rsi, [rbx+codeMap] */
+    emitByte(jit, CTXOFFSET(codeMap));
+    for (i=0; i<NUMREGS; i++) {
+        /* mov r(8+i)d, [rbx+reg+4i] */
+        emitByte(jit, 0x44); emitByte(jit, 0x8B); emitByte(jit, 0x43 | i << 3);
+        emitByte(jit, CTXOFFSET(reg) + 4 * i);
+    }
+    emitByte(jit, 0xFF); emitByte(jit, 0xE0); /* jmp rax */
+
+    jit->exitRoutine = jit->codeUsed;
+    emitByte(jit, 0x89); emitByte(jit, 0x53); emitByte(jit, CTXOFFSET(exitSite)); /* mov [rbx+exitSite], edx */
+    for (i=0; i<NUMREGS; i++) {
+        /* mov [rbx+reg+4i], r(8+i)d */
+        emitByte(jit, 0x44); emitByte(jit, 0x89); emitByte(jit, 0x43 | i << 3);
+        emitByte(jit, CTXOFFSET(reg) + 4 * i);
+    }
+    for (i=0; i<(int)sizeof(pops); i++)
+        emitByte(jit, pops[i]);
+    emitByte(jit, 0xC3); /* ret */
+
+    jit->flushMark = jit->codeUsed;
+}
+
+/*
+ * Drop every translation.  Chained jumps only ever point at blocks in the
+ * same generation, so flushing everything never leaves a dangling chain.
+ */
+void jitFlush(jitType *jit) {
+    int i;
+    for (i=0; i<jit->numBlocks; i++) {
+        jit->blockAt[jit->blocks[i].pc] = -1;
+        memset(jit->codeMap + jit->blocks[i].pc, 0, jit->blocks[i].length);
+    }
+    jit->numBlocks = 0;
+    jit->codeUsed = jit->flushMark;
+    jit->numSites = 0;
+    jit->generation++;
+}
+
+/*
+ * Memory at addr changed behind the JIT's back; drop stale translations.
+ */
+void jitInvalidate(jitType *jit, int addr) {
+    if (jit->codeMap[addr])
+        jitFlush(jit);
+}
+
+jitType *jitCreate(void) {
+    jitType *jit = calloc(1, sizeof(jitType));
+    if (jit == NULL)
+        return NULL;
+    jit->code = mmap(NULL, JITCODESIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->ctx.codeMap = jit->codeMap;
+    memset(jit->blockAt, -1, sizeof(jit->blockAt));
+    emitRuntime(jit);
+    return jit;
+}
+
+/* Release a translation cache and its code buffer; NULL is ignored */
+void jitDestroy(jitType *jit) {
+    if (jit == NULL)
+        return;
+    munmap(jit->code, JITCODESIZE);
+    free(jit->sites);
+    free(jit);
+}
+
+/*
+ * Return the code offset of the block starting at pc, translating it first
+ * if needed.
+ */
+int jitTranslate(jitType *jit, stateType *statePtr, int pc) {
+    if (jit->blockAt[pc] >= 0)
+        return jit->blockAt[pc];
+    if (jit->codeUsed + JITMAXBLOCKBYTES > JITCODESIZE)
+        jitFlush(jit);
+
+    /* find the end of the block first; the prologue needs its length */
+    int length = 0, end;
+    for (end=pc; end<NUMMEMORY && length<JITMAXBLOCK; end++) {
+        int opcode = (statePtr->mem[end] >> 22) & 0x7;
+        length++;
+        if (opcode == BEQ || opcode == JALR || opcode == HALT)
+            break;
+    }
+
+    int start = jit->codeUsed;
+    jit->blockAt[pc] = start;
+
+    /* add qword [rbx], length */
+    emitByte(jit, 0x48); emitByte(jit, 0x81); emitByte(jit, 0x03);
+    emitInt(jit, length);
+
+    int addr, n;
+    for (addr=pc, n=1; n<=length; addr++, n++) {
         command cc;
-        cc.opcode = opcode;
-
-        /* Store regA and regB register values */
-        cc.regA = mem_bin[21]*4 + mem_bin[20]*2 + mem_bin[19];
-        cc.regB = mem_bin[18]*4 + mem_bin[17]*2 + mem_bin[16];
-
-        /* Execute differing commands based on the opcode
-            R-type  */
-        if (strcmp(cc.opcode, "add")==0 || strcmp(cc.opcode, "nand")==0) {
-
-            /* Store regA, regB and dest register values */
-            cc.dest = mem_bin[2]*4 + mem_bin[1]*2 + mem_bin[0];
-
-            if (strcmp(cc.opcode, "add")==0)
-                state.reg[cc.dest] = state.reg[cc.regA] + state.reg[cc.regB];
-            else
-                state.reg[cc.dest] = ~(state.reg[cc.regA] & state.reg[cc.regB]);
-
-        /* I-type */
-        } else if (strcmp(cc.opcode, "lw")==0 || strcmp(cc.opcode, "sw")==0 || strcmp(cc.opcode, "beq")==0) {
-            
-            int bit_c;
-            int sum = pow(2,15)*mem_bin[15]*-1;
-            for (bit_c=14; bit_c>=0; bit_c--)
-                sum += mem_bin[bit_c]*pow(2,bit_c);
-            cc.offset = sum;
-
-            if (strcmp(cc.opcode, "lw")==0)
-                state.reg[cc.regB] = state.mem[state.reg[cc.regA] + cc.offset];
-            else if (strcmp(cc.opcode, "sw")==0)
-                state.mem[state.reg[cc.regA] + cc.offset] = state.reg[cc.regB];
-            else {
-                if (state.reg[cc.regA]==state.reg[cc.regB])
-                    state.pc += cc.offset;
+        int word = statePtr->mem[addr];
+        cc.opcode = (word >> 22) & 0x7;
+        cc.regA = (word >> 19) & 0x7;
+        cc.regB = (word >> 16) & 0x7;
+        cc.dest = word & 0x7;
+        cc.offset = convertNum(word & 0xFFFF);
+        jit->codeMap[addr] = 1;
+
+        switch (cc.opcode) {
+        case ADD:
+        case NAND:
+            emitRegReg(jit, 0x89, 8 + cc.regA, 0); /* mov eax, regA */
+            if (cc.opcode == ADD) {
+                emitRegReg(jit, 0x01, 8 + cc.regB, 0); /* add eax, regB */
+            } else {
+                emitRegReg(jit, 0x21, 8 + cc.regB, 0); /* and eax, regB */
+                emitByte(jit, 0xF7); emitByte(jit, 0xD0); /* not eax */
             }
+            emitRegReg(jit, 0x89, 0, 8 + cc.dest); /* mov dest, eax */
+            break;
+        case LW:
+            emitAddress(jit, &cc, addr, length - n + 1);
+            /* mov regB, [rdi+rax*4] */
+            emitByte(jit, 0x44); emitByte(jit, 0x8B); emitByte(jit, 0x04 | cc.regB << 3); emitByte(jit, 0x87);
+            break;
+        case SW:
+            emitAddress(jit, &cc, addr, length - n + 1);
+            /* mov [rdi+rax*4], regB */
+            emitByte(jit, 0x44); emitByte(jit, 0x89); emitByte(jit, 0x04 | cc.regB << 3); emitByte(jit, 0x87);
+            /* cmp eax, [rbx+highestStore] ; jle +3 ; mov [rbx+highestStore], eax */
+            emitByte(jit, 0x3B); emitByte(jit, 0x43); emitByte(jit, CTXOFFSET(highestStore));
+            emitByte(jit, 0x7E); emitByte(jit, 0x03);
+            emitByte(jit, 0x89); emitByte(jit, 0x43); emitByte(jit, CTXOFFSET(highestStore));
+            /* cmp byte [rsi+rax], 0 ; je past the exit */
+            emitByte(jit, 0x80); emitByte(jit, 0x3C); emitByte(jit, 0x06); emitByte(jit, 0x00);
+            emitByte(jit, 0x74); emitByte(jit, EARLYEXITBYTES);
+            emitEarlyExit(jit, addr + 1, JITEXITSMC, length - n);
+            break;
+        case BEQ:
+            emitRegReg(jit, 0x39, 8 + cc.regB, 8 + cc.regA); /* cmp regA, regB */
+            emitByte(jit, 0x74); emitByte(jit, 15); /* je over the fall-through site */
+            emitSite(jit, addr + 1);
+            emitSite(jit, addr + 1 + cc.offset);
+            break;
+        case JALR:
+            emitByte(jit, 0x41); emitByte(jit, 0xB8 + cc.regB); /* mov regB, pc+1 */
+            emitInt(jit, addr + 1);
+            emitRegReg(jit, 0x89, 8 + cc.regA, 0); /* mov eax, regA */
+            emitByte(jit, 0xBA); emitInt(jit, JITEXITDYNAMIC);
+            emitByte(jit, 0xE9); emitInt(jit, jit->exitRoutine - (jit->codeUsed + 4));
+            break;
+        case HALT:
+            emitExit(jit, addr, JITEXITHALT);
+            break;
+        default: /* noop */
+            break;
+        }
+    }
 
-        /* J-type */
-        } else if (strcmp(cc.opcode, "jalr")==0) {
+    /* the block was cut short by its length or the end of memory */
+    int last = (statePtr->mem[addr - 1] >> 22) & 0x7;
+    if (last != BEQ && last != JALR && last != HALT)
+        emitSite(jit, addr);
 
-            state.reg[cc.regB] = state.pc + 1;
-            state.pc = state.reg[cc.regA] - 1;
+    jit->blocks[jit->numBlocks].pc = pc;
+    jit->blocks[jit->numBlocks].length = length;
+    jit->numBlocks++;
 
+    return start;
+}
+
+/* The run ends on an error: drop its translations, then report and exit */
+void jitFault(stateType *statePtr, char *message) {
+    jitDestroy(statePtr->jit);
+    statePtr->jit = NULL;
+    tracePrintf("%s\n", message);
+    traceExit(1);
+}
+
+/*
+ * JIT engine.  Tracing needs the state before every instruction, which
+ * generated code never materializes, so traced runs use the switch engine.
+ */
+int runJit(stateType *statePtr, int trace) {
+    if (trace)
+        return runSwitch(statePtr, trace);
+    if (statePtr->jit == NULL)
+        statePtr->jit = jitCreate();
+    jitType *jit = statePtr->jit;
+    if (jit == NULL)
+        return runSwitch(statePtr, trace);
+
+    int (*enter)(jitContextType *, void *) = (int (*)(jitContextType *, void *))jit->code;
+    jitContextType *ctx = &jit->ctx;
+    memcpy(ctx->reg, statePtr->reg, sizeof(ctx->reg));
+    ctx->mem = statePtr->mem;
+    ctx->count = 0;
+    ctx->highestStore = statePtr->highestStore;
+
+    int pc = statePtr->pc;
+    while (1) {
+        if (pc < 0 || pc >= NUMMEMORY) {
+            jitFault(statePtr, "pc went out of the memory range");
         }
+        pc = enter(ctx, jit->code + jitTranslate(jit, statePtr, pc));
+
+        int site = ctx->exitSite;
+        if (site >= 0) {
+            /* chain the site straight to its target for next time */
+            if (pc >= 0 && pc < NUMMEMORY) {
+                int generation = jit->generation;
+                int target = jitTranslate(jit, statePtr, pc);
+                if (generation == jit->generation) {
+                    int from = jit->sites[site].offset;
+                    jit->code[from] = 0xE9;
+                    int rel = target - (from + 5);
+                    memcpy(jit->code + from + 1, &rel, 4);
+                }
+            }
+        } else if (site == JITEXITHALT) {
+            break;
+        } else if (site == JITEXITSMC) {
+            jitFlush(jit);
+        } else if (site == JITEXITFAULT) {
+            jitFault(statePtr, "address out of bounds");
+        }
+    }
+
+    memcpy(statePtr->reg, ctx->reg, sizeof(ctx->reg));
+    statePtr->pc = pc;
+
+    /* stores bypassed the decode cache; forget anything they may have hit */
+    int i;
+    for (i=0; i<=ctx->highestStore; i++)
+        statePtr->decoded[i].opcode = UNDECODED;
+    statePtr->highestStore = ctx->highestStore;
+
+    return ctx->count - 1;
+}
+
+#else
+
+/* No code generator for this host; run the interpreter instead */
+int runJit(stateType *statePtr, int trace) {
+    return runSwitch(statePtr, trace);
+}
+
+void jitFlush(struct jitStruct *jit) {
+}
+
+void jitInvalidate(struct jitStruct *jit, int addr) {
+}
+
+void jitDestroy(struct jitStruct *jit) {
+}
 
-        state.pc++;
+#endif
 
-        convertDec(mem_bin, state.mem[state.pc]);
-        opcode = convertOpcode(mem_bin[24], mem_bin[23], mem_bin[22]);
+int checkAddress(int addr) {
+    if (addr < 0 || addr >= NUMMEMORY) {
+        tracePrintf("address out of bounds\n");
+        traceExit(1);
     }
- 
-    /* Print out the new state */
-    printState(&state);
-    state.pc++;
+    return addr;
+}
 
-    printf("machine halted\ntotal of %d instructions executed\nfinal state of machine:\n", execution+1);
+/*
+ * Return the decoded form of the word at addr, decoding it on first use.
+ */
+command *fetchDecoded(stateType *statePtr, int addr) {
+    if (addr < 0 || addr >= NUMMEMORY) {
+        tracePrintf("pc went out of the memory range\n");
+        traceExit(1);
+    }
+    command *cc = &statePtr->decoded[addr];
+    if (cc->opcode == UNDECODED) {
+        int word = statePtr->mem[addr];
+        cc->opcode = (word >> 22) & 0x7;
+        cc->regA = (word >> 19) & 0x7;
+        cc->regB = (word >> 16) & 0x7;
+        cc->dest = word & 0x7;
+        cc->offset = convertNum(word & 0xFFFF);
+    }
+    return cc;
+}
 
-    /* Print out the new state */
-    printState(&state);
+/*
+ * Trace the state before the instruction cc at statePtr->pc executes.
+ *
+ * Delta traces print one line per instruction once its effects are known:
+ *     <pc>            (beq, noop)
+ *     <pc> r<n> <v>   (register n became v)
+ *     <pc> m<a> <v>   (sw stored v at address a)
+ * Every snapshotInterval steps a full snapshot comes first:
+ *     S <pc> <reg 0> ... <reg 7>
+ *     M <number of words>
+ *     <mem[0]> ... one word per line
+ */
+void traceStep(stateType *statePtr, command *cc) {
+    if (statePtr->traceMode == TRACEFULL) {
+        printState(statePtr);
+        return;
+    }
 
-    return(0);
+    tracePending(statePtr);
+    if (statePtr->snapshotInterval > 0 && statePtr->steps % statePtr->snapshotInterval == 0)
+        traceSnapshot(statePtr);
+    statePtr->steps++;
+    statePtr->pendingPc = statePtr->pc;
+    statePtr->pendingCommand = *cc;
+    statePtr->pendingAddress = statePtr->reg[cc->regA] + cc->offset;
 }
 
-void printState(stateType *statePtr) {
+void traceSnapshot(stateType *statePtr) {
     int i;
-    printf("\n@@@\nstate:\n");
-    printf("\tpc %d\n", statePtr->pc);
-    printf("\tmemory:\n");
+    traceStr("S ");
+    traceInt(statePtr->pc);
+    for (i=0; i<NUMREGS; i++) {
+        traceChar(' ');
+        traceInt(statePtr->reg[i]);
+    }
+    traceStr("\nM ");
+    traceInt(statePtr->numMemory);
+    traceChar('\n');
     for (i=0; i<statePtr->numMemory; i++) {
-        printf("\t\tmem[ %d ] %d\n", i, statePtr->mem[i]);
+        traceInt(statePtr->mem[i]);
+        traceChar('\n');
     }
-    printf("\tregisters:\n");
-    for (i=0; i<NUMREGS; i++) {
-        printf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
-    }
-    printf("end state\n");
-}
-
-char* convertOpcode(int a, int b, int c) {
-    if (!a && !b && !c)
-        return "add";
-    else if (!a && !b && c)
-        return "nand";
-    else if (!a && b && !c)
-        return "lw";
-    else if (!a && b && c)
-        return "sw";
-    else if (a && !b && !c)
-        return "beq";
-    else if (a && !b && c)
-        return "jalr";
-    else if (a && b && !c)
-        return "halt";
-    else if (a && b && c)
-        return "noop";
-    else {
-        printf("Invalid opcode!");
-        exit(1);
-        return NULL;
+}
+
+/*
+ * Print the delta line for the pending instruction, which has now run.
+ */
+void tracePending(stateType *statePtr) {
+    if (statePtr->pendingPc < 0)
+        return;
+    command *cc = &statePtr->pendingCommand;
+    traceInt(statePtr->pendingPc);
+    switch (cc->opcode) {
+    case ADD:
+    case NAND:
+        traceStr(" r");
+        traceInt(cc->dest);
+        traceChar(' ');
+        traceInt(statePtr->reg[cc->dest]);
+        break;
+    case LW:
+    case JALR:
+        traceStr(" r");
+        traceInt(cc->regB);
+        traceChar(' ');
+        traceInt(statePtr->reg[cc->regB]);
+        break;
+    case SW:
+        traceStr(" m");
+        traceInt(statePtr->pendingAddress);
+        traceChar(' ');
+        traceInt(statePtr->mem[statePtr->pendingAddress]);
+        break;
+    default:
+        break;
     }
+    traceChar('\n');
+    statePtr->pendingPc = -1;
 }
 
-void convertDec(int* mem_bin, int sum) {
-    /* Iterate through each bit */
+void printState(stateType *statePtr) {
     int i;
-    for (i=31; i>=0; i--) {
-        if (sum>=pow(2,i)) {
-            mem_bin[i] = 1;
-            sum -= pow(2,i);
-        } else
-            mem_bin[i] = 0;
+    traceStr("\n@@@\nstate:\n\tpc ");
+    traceInt(statePtr->pc);
+    traceStr("\n\tmemory:\n");
+    for (i=0; i<statePtr->numMemory; i++) {
+        traceStr("\t\tmem[ ");
+        traceInt(i);
+        traceStr(" ] ");
+        traceInt(statePtr->mem[i]);
+        traceChar('\n');
+    }
+    traceStr("\tregisters:\n");
+    for (i=0; i<NUMREGS; i++) {
+        traceStr("\t\treg[ ");
+        traceInt(i);
+        traceStr(" ] ");
+        traceInt(statePtr->reg[i]);
+        traceChar('\n');
     }
+    traceStr("end state\n");
 }
 
 int convertNum(int num) {
@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+
+#include "mcimage.h"
+#include "trace.h"
  
 #define NUMMEMORY 65536 /* maximum number of words in memory */
 #define NUMREGS 8 /* number of machine registers */
@@ -18,6 +21,11 @@ typedef struct stateStruct {
     int aluOperand;
     int aluResult;
     int numMemory;
+    int cycle; /* number of states printed so far */
+    int lastAddress; /* memory access in progress, -1 if none */
+    int lastReadFlag;
+    int lastData;
+    int delay; /* cycles until that access completes */
 } stateType;
  
 void printState(stateType *, char *);
@@ -27,13 +35,14 @@ int convertNum(int);
  
 int main(int argc, char *argv[]) {
     int i;
-    char line[MAXLINELENGTH];
     stateType state;
     FILE *filePtr;
  
+    traceInit();
+ 
     if (argc != 2) {
-        printf("error: usage: %s <machine-code file>\n", argv[0]);
-        exit(1);
+        tracePrintf("error: usage: %s <machine-code file>\n", argv[0]);
+        traceExit(1);
     }
  
     /* initialize memories and registers */
@@ -45,27 +54,42 @@ int main(int argc, char *argv[]) {
     }
  
     state.pc=0;
+    state.memoryAddress = 0;
+    state.memoryData = 0;
+    state.instrReg = 0;
+    state.aluOperand = 0;
+    state.aluResult = 0;
+    state.cycle = 0;
+    state.lastAddress = -1;
+    state.lastReadFlag = 0;
+    state.lastData = 0;
+    state.delay = 0;
  
     /* read machine-code file into instruction/data memory (starting at
         address 0) */
  
     filePtr = fopen(argv[1], "r");
     if (filePtr == NULL) {
-        printf("error: can't open file %s\n", argv[1]);
+        tracePrintf("error: can't open file %s\n", argv[1]);
         perror("fopen");
-        exit(1);
+        traceExit(1);
     }
  
-    for (state.numMemory=0; fgets(line, MAXLINELENGTH, filePtr) != NULL;
-        state.numMemory++) {
-        if (sscanf(line, "%d", state.mem+state.numMemory) != 1) {
-            printf("error in reading address %d\n", state.numMemory);
-            exit(1);
-        }
-        printf("memory[%d]=%d\n", state.numMemory, state.mem[state.numMemory]);
+    int entry;
+    state.numMemory = loadImage(filePtr, state.mem, NUMMEMORY, &entry);
+    fclose(filePtr);
+    if (state.numMemory < 0)
+        traceExit(1);
+    for (i=0; i<state.numMemory; i++) {
+        traceStr("memory[");
+        traceInt(i);
+        traceStr("]=");
+        traceInt(state.mem[i]);
+        traceChar('\n');
     }
+    state.pc = entry;
  
-    printf("\n");
+    tracePrintf("\n");
  
     /* run never returns */
     run(state);
@@ -75,23 +99,39 @@ int main(int argc, char *argv[]) {
  
 void printState(stateType *statePtr, char *stateName) {
     int i;
-    static int cycle = 0;
-    printf("\n@@@\nstate %s (cycle %d)\n", stateName, cycle++);
-    printf("\tpc %d\n", statePtr->pc);
-    printf("\tmemory:\n");
+    traceStr("\n@@@\nstate ");
+    traceStr(stateName);
+    traceStr(" (cycle ");
+    traceInt(statePtr->cycle++);
+    traceStr(")\n\tpc ");
+    traceInt(statePtr->pc);
+    traceStr("\n\tmemory:\n");
         for (i=0; i<statePtr->numMemory; i++) {
-            printf("\t\tmem[ %d ] %d\n", i, statePtr->mem[i]);
+            traceStr("\t\tmem[ ");
+            traceInt(i);
+            traceStr(" ] ");
+            traceInt(statePtr->mem[i]);
+            traceChar('\n');
         }
-    printf("\tregisters:\n");
+    traceStr("\tregisters:\n");
         for (i=0; i<NUMREGS; i++) {
-            printf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
+            traceStr("\t\treg[ ");
+            traceInt(i);
+            traceStr(" ] ");
+            traceInt(statePtr->reg[i]);
+            traceChar('\n');
         }
-    printf("\tinternal registers:\n");
-    printf("\t\tmemoryAddress %d\n", statePtr->memoryAddress);
-    printf("\t\tmemoryData %d\n", statePtr->memoryData);
-    printf("\t\tinstrReg %d\n", statePtr->instrReg);
-    printf("\t\taluOperand %d\n", statePtr->aluOperand);
-    printf("\t\taluResult %d\n", statePtr->aluResult);
+    traceStr("\tinternal registers:\n\t\tmemoryAddress ");
+    traceInt(statePtr->memoryAddress);
+    traceStr("\n\t\tmemoryData ");
+    traceInt(statePtr->memoryData);
+    traceStr("\n\t\tinstrReg ");
+    traceInt(statePtr->instrReg);
+    traceStr("\n\t\taluOperand ");
+    traceInt(statePtr->aluOperand);
+    traceStr("\n\t\taluResult ");
+    traceInt(statePtr->aluResult);
+    traceChar('\n');
 }
  
 /*
@@ -101,29 +141,24 @@ void printState(stateType *statePtr, char *stateName) {
  * Return 1 if the memory operation was successful, otherwise return 0
  */
 int memoryAccess(stateType *statePtr, int readFlag) {
-    static int lastAddress = -1;
-    static int lastReadFlag = 0;
-    static int lastData = 0;
-    static int delay = 0;
- 
     if (statePtr->memoryAddress < 0 || statePtr->memoryAddress >= NUMMEMORY) {
-        printf("memory address out of range\n");
-        exit(1);
+        tracePrintf("memory address out of range\n");
+        traceExit(1);
     }
  
     /*
      * If this is a new access, reset the delay clock.
      */
-    if ( (statePtr->memoryAddress != lastAddress) ||
-             (readFlag != lastReadFlag) ||
-             (readFlag == 0 && lastData != statePtr->memoryData) ) {
-        delay = statePtr->memoryAddress % 3;
-        lastAddress = statePtr->memoryAddress;
-        lastReadFlag = readFlag;
-        lastData = statePtr->memoryData;
+    if ( (statePtr->memoryAddress != statePtr->lastAddress) ||
+             (readFlag != statePtr->lastReadFlag) ||
+             (readFlag == 0 && statePtr->lastData != statePtr->memoryData) ) {
+        statePtr->delay = statePtr->memoryAddress % 3;
+        statePtr->lastAddress = statePtr->memoryAddress;
+        statePtr->lastReadFlag = readFlag;
+        statePtr->lastData = statePtr->memoryData;
     }
  
-    if (delay == 0) {
+    if (statePtr->delay == 0) {
         /* memory is ready */
         if (readFlag) {
             statePtr->memoryData = statePtr->mem[statePtr->memoryAddress];
@@ -133,7 +168,7 @@ int memoryAccess(stateType *statePtr, int readFlag) {
         return 1;
     } else {
         /* memory is not ready */
-        delay--;
+        statePtr->delay--;
         return 0;
     }
 }
@@ -310,6 +345,6 @@ void run(stateType state) {
     /* FINAL */
     ALUhalt:
         printState(&state, "ALUhalt");
-        exit(0);
+        traceExit(0);
 
 }
\ No newline at end of file
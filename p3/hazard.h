@@ -0,0 +1,35 @@
+/*
+ * What the hazard unit needs to know about each opcode, shared by the
+ * project 3 in-order cores: which of regA (field 0) and regB (field 1) it
+ * reads, which field names the register it writes (-1 for none), and the
+ * first stage whose output latch holds that result.  Forwarding takes the
+ * newest matching result from EXMEM, MEMWB or WBEND; ID stalls an
+ * instruction whose source is written by one in EX that won't have its
+ * result until after MEM.
+ */
+
+#ifndef HAZARD_H
+#define HAZARD_H
+
+#define EXSTAGE 0 /* result is in EXMEM once the instruction leaves EX */
+#define MEMSTAGE 1 /* result is in MEMWB once the instruction leaves MEM */
+
+typedef struct hazardStruct {
+	int readsA;
+	int readsB;
+	int destField;
+	int readyStage;
+} hazardType;
+
+static hazardType hazardTable[8] = {
+	{ 1, 1, 2, EXSTAGE }, /* add */
+	{ 1, 1, 2, EXSTAGE }, /* nand */
+	{ 1, 0, 1, MEMSTAGE }, /* lw */
+	{ 1, 1, -1, EXSTAGE }, /* sw */
+	{ 1, 1, -1, EXSTAGE }, /* beq */
+	{ 1, 0, 1, EXSTAGE }, /* jalr */
+	{ 0, 0, -1, EXSTAGE }, /* halt */
+	{ 0, 0, -1, EXSTAGE }, /* noop */
+};
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Where a jalr sends fetch, shared by the project 3 cores.
+ *
+ * jalr writes pc+1 to regB before it reads regA, so "jalr rX rX" jumps to
+ * pc+1 rather than to the old value of rX.  fieldA and fieldB are the
+ * register numbers in the instruction, regA the value register fieldA held
+ * before the jalr, and pcPlus1 the address after it.
+ */
+
+#ifndef JALR_H
+#define JALR_H
+
+#define JALRTARGET(fieldA, fieldB, regA, pcPlus1) \
+	((fieldA) == (fieldB) ? (pcPlus1) : (regA))
+
+#endif
@@ -0,0 +1,771 @@
+/*
+ * Out-of-order LC-2K core.
+ *
+ * Each cycle, in this order:
+ *     commit    up to width finished instructions leave the head of the
+ *               reorder buffer (ROB) and update the architectural registers
+ *               and memory, stores included, so exceptions are precise
+ *     execute   each functional unit (ALU for add/nand, load/store, branch
+ *               for beq/jalr) starts the oldest of its reservation stations
+ *               whose operands are ready, and one load in the load/store
+ *               queue (LSQ) reads memory or takes the data of an older store;
+ *               a sw only needs its address to start, its data can follow
+ *     writeback results go to the ROB and wake up waiting stations
+ *     dispatch  up to width instructions are fetched, renamed and placed in
+ *               the ROB, a station and, for lw and sw, the LSQ
+ * Registers are renamed to ROB entries: the register alias table (RAT)
+ * names the entry that will produce each register, or -1 when the value is
+ * in the architectural register file.  beq is predicted with a table of
+ * 2-bit counters and resolves in the branch unit, which squashes everything
+ * younger on a mispredict; dispatch waits for a jalr to execute.  A load
+ * waits until every older store knows its address, and one to the same word
+ * knows its data, which it then forwards.  A store that commits
+ * over an instruction already fetched flushes everything after it, so
+ * self-modifying code runs as in project 1.
+ *
+ * usage: ooo [-w width] [-r robSize] [-t aluStations,loadStoreStations,branchStations]
+ *            [-q lsqSize] [-s] [-c] <machine-code file>
+ *
+ * Prints what "p1/simulate -q" prints for the same program.  -s adds
+ * statistics; -c steps a project 1 style interpreter alongside and stops at
+ * the first committed instruction that differs from it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mcimage.h"
+#include "trace.h"
+#include "jalr.h"
+
+#define NUMMEMORY 65536 /* maximum number of words in memory */
+#define NUMREGS 8 /* number of machine registers */
+
+#define ADD 0
+#define NAND 1
+#define LW 2
+#define SW 3
+#define BEQ 4
+#define JALR 5
+#define HALT 6
+#define NOOP 7
+
+#define MAXROB 256 /* largest reorder buffer, LSQ and station sizes */
+#define MAXSTATIONS 64
+#define PHTSIZE 1024 /* 2-bit counters in the branch predictor */
+
+#define ALUUNIT 0 /* functional units, each with its own stations */
+#define LOADSTOREUNIT 1
+#define BRANCHUNIT 2
+#define NUMUNITS 3
+
+#define NOEXCEPTION 0
+#define BADADDRESS 1 /* lw or sw outside memory */
+#define BADPC 2 /* fetched outside memory */
+
+#define FETCHING 0 /* why dispatch is not fetching */
+#define JALRWAIT 1
+#define HALTED 2
+
+#define ROBFULL 0 /* why dispatch stopped short of width, see stallNames */
+#define STATIONSFULL 1 /* plus the unit */
+#define LSQFULL (STATIONSFULL + NUMUNITS)
+#define WAITINGJALR (LSQFULL + 1)
+#define NUMSTALLS (WAITINGJALR + 1)
+
+typedef struct robStruct {
+	int pc;
+	int opcode;
+	int regA;
+	int regB;
+	int offset;
+	int destReg; /* architectural register written, -1 if none */
+	int value; /* what destReg gets */
+	int done;
+	int exception;
+	int predictedTaken;
+	int mispredicted;
+	int lsq; /* LSQ entry of a lw or sw, -1 for other instructions */
+} robEntry;
+
+typedef struct stationStruct {
+	int busy;
+	int rob; /* the instruction this station holds */
+	int value[2]; /* regA and regB operands */
+	int waiting[2]; /* ROB entry each operand waits for, -1 once it has a value */
+} stationType;
+
+typedef struct unitStruct {
+	char *name;
+	int size;
+	stationType stations[MAXSTATIONS];
+} unitType;
+
+typedef struct lsqStruct {
+	int rob;
+	int isStore;
+	int addressKnown;
+	int address; /* -1 if outside memory */
+	int data; /* value a store writes */
+	int dataWaiting; /* ROB entry a store's data comes from, -1 once known */
+	int done; /* a load has its data */
+} lsqEntry;
+
+/* The plain instruction-level model -c checks commits against */
+typedef struct referenceStruct {
+	int pc;
+	int reg[NUMREGS];
+	int *mem;
+} referenceType;
+
+typedef struct stateStruct {
+	int pc; /* next instruction dispatch fetches */
+	int fetchState;
+	int *mem;
+	int reg[NUMREGS]; /* architectural registers */
+	int rat[NUMREGS];
+	int numMemory;
+	int width;
+	robEntry rob[MAXROB];
+	int robSize;
+	int robHead;
+	int robCount;
+	unitType units[NUMUNITS];
+	lsqEntry lsq[MAXROB];
+	int lsqSize;
+	int lsqHead;
+	int lsqCount;
+	unsigned char counters[PHTSIZE];
+	int halted;
+	int haltPc;
+	referenceType *reference; /* NULL unless checking in lockstep */
+	long long cycles;
+	long long committed;
+	long long robOccupancy; /* sum over cycles of ROB entries in use */
+	int robPeak;
+	long long stalls[NUMSTALLS]; /* cycles dispatch stopped short, by cause */
+	long long branches;
+	long long mispredicts;
+	long long loads; /* dispatched, including down mispredicted paths */
+	long long forwarded; /* loads that took their data from an older store */
+	long long loadWaits; /* cycles a load waited on an older store */
+	long long codeFlushes; /* commits of stores over fetched instructions */
+} stateType;
+
+/* Results finishing this cycle, written back together */
+typedef struct resultStruct {
+	int rob;
+	int value;
+	int exception;
+} resultType;
+
+char *stallNames[NUMSTALLS] = { "ROB full", "ALU stations full", "load/store stations full",
+	"branch stations full", "LSQ full", "waiting on jalr" };
+
+void printState(stateType *);
+void printStats(stateType *);
+int unitOf(int);
+int readsA(int);
+int readsB(int);
+int robAge(stateType *, int);
+void cycle(stateType *);
+int commit(stateType *);
+void execute(stateType *, resultType *, int *);
+void writeback(stateType *, resultType *, int);
+void dispatch(stateType *);
+void squash(stateType *, int);
+void checkCommit(stateType *, robEntry *);
+int convertNum(int);
+
+int main(int argc, char *argv[]) {
+    stateType state;
+    int mem[NUMMEMORY];
+    int referenceMem[NUMMEMORY];
+    referenceType reference;
+    char *progName = argv[0];
+    char *stationSizes = "8,8,4";
+    int stats = 0, lockstep = 0;
+    FILE *filePtr;
+    int i;
+
+    traceInit();
+
+    memset(&state, 0, sizeof(state));
+    state.width = 4;
+    state.robSize = 32;
+    state.lsqSize = 16;
+
+    /* -w sets fetch, dispatch and commit width, -r the ROB size, -t the
+        stations in each unit, -q the LSQ size, -s prints statistics, -c
+        checks every commit against an instruction-level model */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-s")==0 || strcmp(argv[1], "-c")==0) {
+            if (argv[1][1] == 's')
+                stats = 1;
+            else
+                lockstep = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 4)
+            break;
+        if (strcmp(argv[1], "-w")==0)
+            state.width = atoi(argv[2]);
+        else if (strcmp(argv[1], "-r")==0)
+            state.robSize = atoi(argv[2]);
+        else if (strcmp(argv[1], "-t")==0)
+            stationSizes = argv[2];
+        else if (strcmp(argv[1], "-q")==0)
+            state.lsqSize = atoi(argv[2]);
+        else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
+
+    char *unitNames[NUMUNITS] = { "ALU", "load/store", "branch" };
+    for (i=0; i<NUMUNITS; i++)
+        state.units[i].name = unitNames[i];
+    if (argc != 2 || state.width < 1 || state.robSize < 1 || state.robSize > MAXROB ||
+            state.lsqSize < 1 || state.lsqSize > MAXROB ||
+            sscanf(stationSizes, "%d,%d,%d", &state.units[ALUUNIT].size,
+                &state.units[LOADSTOREUNIT].size, &state.units[BRANCHUNIT].size) != 3 ||
+            state.units[ALUUNIT].size < 1 || state.units[ALUUNIT].size > MAXSTATIONS ||
+            state.units[LOADSTOREUNIT].size < 1 || state.units[LOADSTOREUNIT].size > MAXSTATIONS ||
+            state.units[BRANCHUNIT].size < 1 || state.units[BRANCHUNIT].size > MAXSTATIONS) {
+        tracePrintf("error: usage: %s [-w width] [-r robSize (1-%d)] [-t aluStations,loadStoreStations,branchStations (1-%d each)] [-q lsqSize (1-%d)] [-s] [-c] <machine-code file>\n",
+            progName, MAXROB, MAXSTATIONS, MAXROB);
+        traceExit(1);
+    }
+
+    filePtr = fopen(argv[1], "r");
+    if (filePtr == NULL) {
+        tracePrintf("error: can't open file %s", argv[1]);
+        perror("fopen");
+        traceExit(1);
+    }
+
+    /* read in the entire machine-code file (text or binary) into memory;
+        words past the end of the program read as 0 */
+    memset(mem, 0, sizeof(mem));
+    int entry;
+    state.mem = mem;
+    state.numMemory = loadImage(filePtr, state.mem, NUMMEMORY, &entry);
+    fclose(filePtr);
+    if (state.numMemory < 0)
+        traceExit(1);
+
+    /* Initialization: every register in the register file, counters weakly not-taken */
+    state.pc = entry;
+    for (i=0; i<NUMREGS; i++)
+        state.rat[i] = -1;
+    memset(state.counters, 1, sizeof(state.counters));
+    if (lockstep) {
+        memcpy(referenceMem, mem, sizeof(mem));
+        memset(&reference, 0, sizeof(reference));
+        reference.pc = entry;
+        reference.mem = referenceMem;
+        state.reference = &reference;
+    }
+
+    for (i=0; i<state.numMemory; i++) {
+        traceStr("memory[");
+        traceInt(i);
+        traceStr("]=");
+        traceInt(state.mem[i]);
+        traceChar('\n');
+    }
+
+    while (!state.halted)
+        cycle(&state);
+
+    state.pc = state.haltPc + 1;
+    tracePrintf("machine halted\ntotal of %lld instructions executed\nfinal state of machine:\n", state.committed);
+    printState(&state);
+    if (stats)
+        printStats(&state);
+
+    return(0);
+}
+
+void printState(stateType *statePtr) {
+    int i;
+    traceStr("\n@@@\nstate:\n\tpc ");
+    traceInt(statePtr->pc);
+    traceStr("\n\tmemory:\n");
+    for (i=0; i<statePtr->numMemory; i++) {
+        traceStr("\t\tmem[ ");
+        traceInt(i);
+        traceStr(" ] ");
+        traceInt(statePtr->mem[i]);
+        traceChar('\n');
+    }
+    traceStr("\tregisters:\n");
+    for (i=0; i<NUMREGS; i++) {
+        traceStr("\t\treg[ ");
+        traceInt(i);
+        traceStr(" ] ");
+        traceInt(statePtr->reg[i]);
+        traceChar('\n');
+    }
+    traceStr("end state\n");
+}
+
+void printStats(stateType *statePtr) {
+	int i;
+	double cycles = statePtr->cycles > 0 ? statePtr->cycles : 1;
+	tracePrintf("width %d, ROB %d, stations %d,%d,%d, LSQ %d\n", statePtr->width, statePtr->robSize,
+		statePtr->units[ALUUNIT].size, statePtr->units[LOADSTOREUNIT].size,
+		statePtr->units[BRANCHUNIT].size, statePtr->lsqSize);
+	tracePrintf("%lld instructions in %lld cycles, IPC %.3f\n", statePtr->committed,
+		statePtr->cycles, statePtr->committed / cycles);
+	tracePrintf("ROB occupancy average %.2f, peak %d\n", statePtr->robOccupancy / cycles, statePtr->robPeak);
+	for (i=0; i<NUMSTALLS; i++)
+		tracePrintf("dispatch stalled by %s %lld\n", stallNames[i], statePtr->stalls[i]);
+	tracePrintf("%lld branches, %lld mispredicted, accuracy %.2f%%\n", statePtr->branches,
+		statePtr->mispredicts, statePtr->branches > 0 ?
+		100.0 * (statePtr->branches - statePtr->mispredicts) / statePtr->branches : 100.0);
+	tracePrintf("%lld loads, %lld forwarded from stores, %lld cycles waiting on older stores\n",
+		statePtr->loads, statePtr->forwarded, statePtr->loadWaits);
+	tracePrintf("%lld flushes for stores over fetched instructions\n", statePtr->codeFlushes);
+}
+
+int convertNum(int num) {
+	/* convert a 16-bit number into a 32-bit integer */
+	if (num & (1 << 15) ) {
+		num -= (1 << 16);
+	}
+	return num;
+}
+
+/* functional unit an opcode executes on, -1 for halt and noop */
+int unitOf(int opcode) {
+	if (opcode==ADD || opcode==NAND)
+		return ALUUNIT;
+	if (opcode==LW || opcode==SW)
+		return LOADSTOREUNIT;
+	if (opcode==BEQ || opcode==JALR)
+		return BRANCHUNIT;
+	return -1;
+}
+
+int readsA(int opcode) {
+	return opcode != HALT && opcode != NOOP;
+}
+
+int readsB(int opcode) {
+	return opcode==ADD || opcode==NAND || opcode==SW || opcode==BEQ;
+}
+
+/* position of ROB entry rob counting from the head, 0 for the oldest */
+int robAge(stateType *statePtr, int rob) {
+	return (rob - statePtr->robHead + statePtr->robSize) % statePtr->robSize;
+}
+
+void cycle(stateType *statePtr) {
+	resultType results[NUMUNITS + 1];
+	int numResults = 0;
+
+	statePtr->cycles++;
+	statePtr->robOccupancy += statePtr->robCount;
+	if (statePtr->robCount > statePtr->robPeak)
+		statePtr->robPeak = statePtr->robCount;
+
+	if (commit(statePtr))
+		return;
+	execute(statePtr, results, &numResults);
+	writeback(statePtr, results, numResults);
+	dispatch(statePtr);
+}
+
+/*
+ * Retire finished instructions from the head of the ROB in program order.
+ * Returns 1 once the halt commits.
+ */
+int commit(stateType *statePtr) {
+	int n;
+	for (n=0; n<statePtr->width && statePtr->robCount > 0; n++) {
+		int head = statePtr->robHead;
+		robEntry *entry = &statePtr->rob[head];
+		if (!entry->done)
+			break;
+
+		/* the same errors project 1 reports, now that the instruction is not speculative */
+		if (entry->exception == BADPC) {
+			tracePrintf("pc went out of the memory range\n");
+			traceExit(1);
+		}
+		if (entry->exception == BADADDRESS) {
+			tracePrintf("address out of bounds\n");
+			traceExit(1);
+		}
+		if (statePtr->reference != NULL)
+			checkCommit(statePtr, entry);
+
+		statePtr->committed++;
+		if (entry->opcode == BEQ) {
+			statePtr->branches++;
+			statePtr->mispredicts += entry->mispredicted;
+		}
+		statePtr->robHead = (head + 1) % statePtr->robSize;
+		statePtr->robCount--;
+		if (entry->destReg >= 0) {
+			statePtr->reg[entry->destReg] = entry->value;
+			if (statePtr->rat[entry->destReg] == head)
+				statePtr->rat[entry->destReg] = -1;
+		}
+		if (entry->opcode == HALT) {
+			statePtr->halted = 1;
+			statePtr->haltPc = entry->pc;
+			return 1;
+		}
+		if (entry->lsq < 0)
+			continue;
+
+		lsqEntry *access = &statePtr->lsq[entry->lsq];
+		statePtr->lsqHead = (statePtr->lsqHead + 1) % statePtr->lsqSize;
+		statePtr->lsqCount--;
+		if (access->isStore) {
+			statePtr->mem[access->address] = access->data;
+			/* anything younger may have been fetched from the old word */
+			int i;
+			for (i=0; i<statePtr->robCount; i++)
+				if (statePtr->rob[(statePtr->robHead + i) % statePtr->robSize].pc == access->address)
+					break;
+			if (i < statePtr->robCount) {
+				statePtr->codeFlushes++;
+				squash(statePtr, 0);
+				statePtr->pc = entry->pc + 1;
+				statePtr->fetchState = FETCHING;
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start the oldest ready station in each unit and one load's memory
+ * access.  Everything takes a cycle; results are written back at the end
+ * of it, so a dependent instruction starts the cycle after its producer.
+ */
+void execute(stateType *statePtr, resultType *results, int *numResults) {
+	int u, i;
+
+	/* the oldest load whose address is known and that has no data yet */
+	for (i=0; i<statePtr->lsqCount; i++) {
+		int index = (statePtr->lsqHead + i) % statePtr->lsqSize;
+		lsqEntry *load = &statePtr->lsq[index];
+		if (load->isStore || !load->addressKnown || load->done || load->address < 0)
+			continue;
+
+		/* the youngest older store to the same word supplies the data */
+		int j, blocked = 0, forwarded = 0, value = 0;
+		for (j=i-1; j>=0 && !forwarded && !blocked; j--) {
+			lsqEntry *store = &statePtr->lsq[(statePtr->lsqHead + j) % statePtr->lsqSize];
+			if (!store->isStore)
+				continue;
+			if (!store->addressKnown)
+				blocked = 1;
+			else if (store->address == load->address) {
+				blocked = store->dataWaiting >= 0;
+				forwarded = !blocked;
+				value = store->data;
+			}
+		}
+		if (blocked) {
+			statePtr->loadWaits++;
+			continue;
+		}
+		if (forwarded)
+			statePtr->forwarded++;
+		else
+			value = statePtr->mem[load->address];
+		load->done = 1;
+		results[*numResults].rob = load->rob;
+		results[*numResults].value = value;
+		results[*numResults].exception = NOEXCEPTION;
+		(*numResults)++;
+		break;
+	}
+
+	int squashAge = -1, redirect = 0;
+	for (u=0; u<NUMUNITS; u++) {
+		unitType *unit = &statePtr->units[u];
+		stationType *oldest = NULL;
+		for (i=0; i<unit->size; i++) {
+			stationType *station = &unit->stations[i];
+			/* a sw goes as soon as it has its address; the data can follow */
+			if (station->busy && station->waiting[0] < 0 &&
+					(station->waiting[1] < 0 || statePtr->rob[station->rob].opcode == SW) &&
+					(oldest == NULL || robAge(statePtr, station->rob) < robAge(statePtr, oldest->rob)))
+				oldest = station;
+		}
+		if (oldest == NULL)
+			continue;
+		oldest->busy = 0;
+
+		robEntry *entry = &statePtr->rob[oldest->rob];
+		int regA = oldest->value[0], regB = oldest->value[1];
+		resultType *result = &results[*numResults];
+		result->rob = oldest->rob;
+		result->value = 0;
+		result->exception = NOEXCEPTION;
+
+		if (entry->opcode == ADD)
+			result->value = regA + regB;
+		else if (entry->opcode == NAND)
+			result->value = ~(regA & regB);
+		else if (entry->opcode == LW || entry->opcode == SW) {
+			lsqEntry *access = &statePtr->lsq[entry->lsq];
+			access->addressKnown = 1;
+			access->address = regA + entry->offset;
+			access->data = regB;
+			access->dataWaiting = oldest->waiting[1];
+			if (access->address < 0 || access->address >= NUMMEMORY) {
+				access->address = -1;
+				result->exception = BADADDRESS;
+			} else if (entry->opcode == LW)
+				continue; /* done once the LSQ has its data */
+			else if (access->dataWaiting >= 0)
+				continue; /* done once its data is written back */
+		} else if (entry->opcode == BEQ) {
+			int taken = regA == regB;
+			unsigned char *counter = &statePtr->counters[entry->pc % PHTSIZE];
+			if (taken && *counter < 3)
+				(*counter)++;
+			else if (!taken && *counter > 0)
+				(*counter)--;
+			if (taken != entry->predictedTaken) {
+				entry->mispredicted = 1;
+				squashAge = robAge(statePtr, oldest->rob);
+				redirect = taken ? entry->pc + 1 + entry->offset : entry->pc + 1;
+			}
+		} else if (entry->opcode == JALR) {
+			/* the return address goes to regB; dispatch resumes at regA */
+			result->value = entry->pc + 1;
+			statePtr->pc = JALRTARGET(entry->regA, entry->regB, regA, entry->pc + 1);
+			statePtr->fetchState = FETCHING;
+		}
+		(*numResults)++;
+	}
+
+	if (squashAge >= 0) {
+		squash(statePtr, squashAge + 1);
+		statePtr->pc = redirect;
+		statePtr->fetchState = FETCHING;
+	}
+}
+
+void writeback(stateType *statePtr, resultType *results, int numResults) {
+	int i, u, s, k;
+	for (i=0; i<numResults; i++) {
+		/* squashed along with a mispredicted branch */
+		if (robAge(statePtr, results[i].rob) >= statePtr->robCount)
+			continue;
+		robEntry *entry = &statePtr->rob[results[i].rob];
+		entry->done = 1;
+		entry->value = results[i].value;
+		entry->exception = results[i].exception;
+		for (k=0; k<statePtr->lsqCount; k++) {
+			lsqEntry *store = &statePtr->lsq[(statePtr->lsqHead + k) % statePtr->lsqSize];
+			if (store->isStore && store->dataWaiting == results[i].rob) {
+				store->dataWaiting = -1;
+				store->data = results[i].value;
+				statePtr->rob[store->rob].done = 1;
+			}
+		}
+		for (u=0; u<NUMUNITS; u++) {
+			for (s=0; s<statePtr->units[u].size; s++) {
+				stationType *station = &statePtr->units[u].stations[s];
+				for (k=0; k<2; k++) {
+					if (station->busy && station->waiting[k] == results[i].rob) {
+						station->waiting[k] = -1;
+						station->value[k] = results[i].value;
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Fetch, rename and dispatch up to width instructions from pc.
+ */
+void dispatch(stateType *statePtr) {
+	int n, k;
+	for (n=0; n<statePtr->width; n++) {
+		if (statePtr->fetchState != FETCHING) {
+			if (statePtr->fetchState == JALRWAIT)
+				statePtr->stalls[WAITINGJALR]++;
+			return;
+		}
+		if (statePtr->robCount == statePtr->robSize) {
+			statePtr->stalls[ROBFULL]++;
+			return;
+		}
+
+		int pc = statePtr->pc;
+		int word = (pc >= 0 && pc < NUMMEMORY) ? statePtr->mem[pc] : NOOP << 22;
+		int opcode = (word >> 22) & 0x7;
+		int unit = unitOf(opcode);
+		stationType *station = NULL;
+		if (unit >= 0) {
+			for (k=0; k<statePtr->units[unit].size && statePtr->units[unit].stations[k].busy; k++)
+				;
+			if (k == statePtr->units[unit].size) {
+				statePtr->stalls[STATIONSFULL + unit]++;
+				return;
+			}
+			station = &statePtr->units[unit].stations[k];
+		}
+		if ((opcode == LW || opcode == SW) && statePtr->lsqCount == statePtr->lsqSize) {
+			statePtr->stalls[LSQFULL]++;
+			return;
+		}
+
+		int tag = (statePtr->robHead + statePtr->robCount) % statePtr->robSize;
+		robEntry *entry = &statePtr->rob[tag];
+		statePtr->robCount++;
+		memset(entry, 0, sizeof(robEntry));
+		entry->pc = pc;
+		entry->opcode = opcode;
+		entry->regA = (word >> 19) & 0x7;
+		entry->regB = (word >> 16) & 0x7;
+		entry->offset = convertNum(word & 0xFFFF);
+		entry->destReg = -1;
+		entry->lsq = -1;
+		statePtr->pc = pc + 1;
+
+		if (pc < 0 || pc >= NUMMEMORY) {
+			/* reported if it commits; until a redirect there is nothing to fetch */
+			entry->done = 1;
+			entry->exception = BADPC;
+			statePtr->fetchState = HALTED;
+			return;
+		}
+
+		if (station != NULL) {
+			/* operands come from the register file, a finished ROB entry, or later */
+			int regs[2] = { entry->regA, entry->regB };
+			int reads[2] = { readsA(opcode), readsB(opcode) };
+			station->busy = 1;
+			station->rob = tag;
+			for (k=0; k<2; k++) {
+				int producer = statePtr->rat[regs[k]];
+				station->waiting[k] = -1;
+				station->value[k] = 0;
+				if (!reads[k])
+					continue;
+				if (producer < 0)
+					station->value[k] = statePtr->reg[regs[k]];
+				else if (statePtr->rob[producer].done)
+					station->value[k] = statePtr->rob[producer].value;
+				else
+					station->waiting[k] = producer;
+			}
+		}
+
+		if (opcode == ADD || opcode == NAND)
+			entry->destReg = word & 0x7;
+		else if (opcode == LW || opcode == JALR)
+			entry->destReg = entry->regB;
+		if (entry->destReg >= 0)
+			statePtr->rat[entry->destReg] = tag;
+
+		if (opcode == LW || opcode == SW) {
+			entry->lsq = (statePtr->lsqHead + statePtr->lsqCount) % statePtr->lsqSize;
+			statePtr->lsqCount++;
+			lsqEntry *access = &statePtr->lsq[entry->lsq];
+			memset(access, 0, sizeof(lsqEntry));
+			access->rob = tag;
+			access->isStore = opcode == SW;
+			access->dataWaiting = -1;
+			if (opcode == LW)
+				statePtr->loads++;
+		} else if (opcode == BEQ) {
+			entry->predictedTaken = statePtr->counters[pc % PHTSIZE] >= 2;
+			if (entry->predictedTaken)
+				statePtr->pc = pc + 1 + entry->offset;
+		} else if (opcode == JALR) {
+			statePtr->fetchState = JALRWAIT;
+		} else if (opcode == HALT || opcode == NOOP) {
+			entry->done = 1;
+			if (opcode == HALT)
+				statePtr->fetchState = HALTED;
+		}
+	}
+}
+
+/*
+ * Throw away every ROB entry past the oldest keep, with their stations and
+ * LSQ entries, and point the RAT back at whatever is left.
+ */
+void squash(stateType *statePtr, int keep) {
+	int u, s, i;
+	for (u=0; u<NUMUNITS; u++)
+		for (s=0; s<statePtr->units[u].size; s++) {
+			stationType *station = &statePtr->units[u].stations[s];
+			if (station->busy && robAge(statePtr, station->rob) >= keep)
+				station->busy = 0;
+		}
+	while (statePtr->lsqCount > 0) {
+		int tail = (statePtr->lsqHead + statePtr->lsqCount - 1) % statePtr->lsqSize;
+		if (robAge(statePtr, statePtr->lsq[tail].rob) < keep)
+			break;
+		statePtr->lsqCount--;
+	}
+	statePtr->robCount = keep;
+
+	for (i=0; i<NUMREGS; i++)
+		statePtr->rat[i] = -1;
+	for (i=0; i<keep; i++) {
+		int rob = (statePtr->robHead + i) % statePtr->robSize;
+		if (statePtr->rob[rob].destReg >= 0)
+			statePtr->rat[statePtr->rob[rob].destReg] = rob;
+	}
+}
+
+/*
+ * Lockstep check: run the reference model for one instruction and make sure
+ * the instruction about to commit is the same one and did the same thing.
+ */
+void checkCommit(stateType *statePtr, robEntry *entry) {
+	referenceType *ref = statePtr->reference;
+	int word = (ref->pc >= 0 && ref->pc < NUMMEMORY) ? ref->mem[ref->pc] : HALT << 22;
+	int opcode = (word >> 22) & 0x7;
+	int regA = ref->reg[(word >> 19) & 0x7];
+	int regB = ref->reg[(word >> 16) & 0x7];
+	int offset = convertNum(word & 0xFFFF);
+	int ok = entry->pc == ref->pc && entry->opcode == opcode &&
+		((opcode != LW && opcode != SW) || (regA + offset >= 0 && regA + offset < NUMMEMORY));
+	int pc = ref->pc;
+
+	ref->pc++;
+	if (ok && opcode == ADD)
+		ok = entry->value == (ref->reg[word & 0x7] = regA + regB);
+	else if (ok && opcode == NAND)
+		ok = entry->value == (ref->reg[word & 0x7] = ~(regA & regB));
+	else if (ok && opcode == LW)
+		ok = entry->value == (ref->reg[(word >> 16) & 0x7] = ref->mem[regA + offset]);
+	else if (ok && opcode == SW) {
+		lsqEntry *access = &statePtr->lsq[entry->lsq];
+		ok = access->address == regA + offset && access->data == regB;
+		ref->mem[regA + offset] = regB;
+	} else if (ok && opcode == BEQ) {
+		if (regA == regB)
+			ref->pc += offset;
+	} else if (ok && opcode == JALR) {
+		ok = entry->value == pc + 1;
+		ref->reg[(word >> 16) & 0x7] = pc + 1;
+		ref->pc = JALRTARGET((word >> 19) & 0x7, (word >> 16) & 0x7, regA, pc + 1);
+	}
+
+	if (!ok) {
+		tracePrintf("error: lockstep mismatch after %lld instructions: reference at pc %d, core committing pc %d\n",
+			statePtr->committed, pc, entry->pc);
+		traceExit(1);
+	}
+}
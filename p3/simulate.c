@@ -1,6 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#include "mcimage.h"
+#include "trace.h"
+#include "jalr.h"
+#include "hazard.h"
 
 #define NUMMEMORY 65536 /* maximum number of data words in memory */
 #define NUMREGS 8 /* number of machine registers */
@@ -11,15 +17,41 @@
 #define LW 2
 #define SW 3
 #define BEQ 4
-#define JALR 5 /* JALR will not implemented for Project 3 */
+#define JALR 5
 #define HALT 6
 #define NOOP 7
 
 #define NOOPINSTRUCTION 0x1c00000
 
+#define LOADUSE 0 /* stall causes, see lostCycles */
+#define BRANCHFLUSH 1
+#define JALRFLUSH 2
+#define ICACHEMISS 3
+#define DCACHEMISS 4
+#define NUMCAUSES 5
+
+#define KONATALABEL 48 /* longest instruction label in the pipeline viewer log */
+
+#define MISSLATENCY 10 /* default cycles to bring a block in from memory */
+
+#define BTBSIZE 64 /* branch target buffer entries, direct mapped */
+#define PHTSIZE 1024 /* counters in each prediction table */
+#define HISTORYBITS 10 /* global branch history length for gshare */
+
+/*
+ * Latch fields past the ones printState shows are bookkeeping: valid is 0
+ * for bubbles, id numbers instructions in fetch order for the pipeline
+ * viewer log, and predictedTaken follows a beq down to MEM, where it is
+ * checked against the real outcome, along with the global history its
+ * prediction was made from.
+ */
 typedef struct IFIDStruct {
 	int instr;
 	int pcPlus1;
+	int valid;
+	int id;
+	int predictedTaken;
+	int history;
 } IFIDType;
 
 typedef struct IDEXStruct {
@@ -28,6 +60,10 @@ typedef struct IDEXStruct {
 	int readRegA;
 	int readRegB;
 	int offset;
+	int valid;
+	int id;
+	int predictedTaken;
+	int history;
 } IDEXType;
 
 typedef struct EXMEMStruct {
@@ -35,11 +71,18 @@ typedef struct EXMEMStruct {
 	int branchTarget;
 	int aluResult;
 	int readRegB;
+	int pcPlus1;
+	int valid;
+	int id;
+	int predictedTaken;
+	int history;
 } EXMEMType;
 
 typedef struct MEMWBStruct {
 	int instr;
 	int writeData;
+	int valid;
+	int id;
 } MEMWBType;
 
 typedef struct WBENDStruct {
@@ -47,10 +90,70 @@ typedef struct WBENDStruct {
 	int writeData;
 } WBENDType;
 
+char *opcodeNames[8] = { "add", "nand", "lw", "sw", "beq", "jalr", "halt", "noop" };
+
+char *causeNames[NUMCAUSES] = { "load-use stalls", "branch mispredicts", "jalr redirects",
+	"instruction cache misses", "data cache misses" };
+
+/*
+ * Timing-only version of the project 4 cache: tags, dirty bits and LRU
+ * counters, but no data, since the pipeline still reads the memory
+ * arrays.  Write-back and write-allocate like project 4, with storage
+ * sized to the geometry and laid out the same way: way w of set s is
+ * entry s * blocksPerSet + w of each array, and a tag of -1 marks an
+ * invalid way.
+ */
+typedef struct cacheStruct {
+	char *name;
+	int blockSize;
+	int numSets;
+	int blocksPerSet;
+	int missLatency; /* cycles per block moved to or from memory */
+	int *tag; /* per way, -1 if invalid */
+	unsigned char *dirty;
+	int *LRUbits;
+	long long accesses;
+	long long misses;
+	long long writebacks;
+} cacheType;
+
+/*
+ * Branch prediction unit.  IF looks the fetch pc up in the BTB and, on a
+ * hit, asks the predictor whether to fetch the target next; MEM trains both
+ * once the beq resolves.  Counters are 2-bit (0-3, taken from 2 up) except
+ * in the 1-bit predictor.
+ */
+typedef struct predictorStruct {
+	struct predictorEntryStruct *kind;
+	int btbPc[BTBSIZE]; /* branch in each entry, -1 if empty */
+	int btbTarget[BTBSIZE];
+	unsigned char local[PHTSIZE]; /* indexed by pc */
+	unsigned char global[PHTSIZE]; /* indexed by pc xor history */
+	unsigned char chooser[PHTSIZE]; /* tournament: 2 up trusts global */
+	int history; /* last HISTORYBITS outcomes, newest in bit 0 */
+	long long branches;
+	long long mispredicts;
+} predictorType;
+
+typedef struct predictorEntryStruct {
+	char *name;
+	int (*predict)(predictorType *, int, int);
+	void (*update)(predictorType *, int, int, int);
+} predictorEntry;
+
+/*
+ * Everything a cycle reads and writes.  run() keeps the state at the start
+ * of the cycle and builds the next one from it, so the two copies hold only
+ * the pc, registers and latches; memory and the predictor are shared through
+ * the pointers and updated in place.
+ */
 typedef struct stateStruct {
 	int pc;
-	int instrMem[NUMMEMORY];
-	int dataMem[NUMMEMORY];
+	int *instrMem;
+	int *dataMem;
+	predictorType *predictor;
+	cacheType *icache; /* NULL for memory with no latency */
+	cacheType *dcache;
 	int reg[NUMREGS];
 	int numMemory;
 	IFIDType IFID;
@@ -59,49 +162,122 @@ typedef struct stateStruct {
 	MEMWBType MEMWB;
 	WBENDType WBEND;
 	int cycles; /* number of cycles run so far */
+	int highestStore; /* highest data address written by sw, -1 if none */
+	int retired; /* instructions that have left the MEM stage */
+	int lostCycles[NUMCAUSES]; /* bubbles inserted, by cause */
+	int fetchWait; /* IF bubbles left for an instruction cache miss, plus one */
+	int refetching; /* IF fetches again the pc a load-use stall sent back, already looked up */
+	int memWait; /* cycles until the data cache miss in MEM is filled */
+	int memAccessed; /* the lw/sw in EXMEM has already been to the data cache */
+	int printStats; /* print statistics when the machine halts */
+	FILE *konata; /* pipeline viewer log, NULL for none */
+	int nextId; /* id of the next instruction fetched */
+	int konataRetired; /* instructions the log has retired */
+	char (*konataLabels)[KONATALABEL]; /* disassembly of each pc, built on first fetch */
 } stateType;
 
 void printInstruction(int instr);
-void run();
+void printStats(stateType *);
+void initCache(cacheType *, char *, char *, int);
+void freeCache(cacheType *);
+int cacheAccess(cacheType *, int, int);
+void printCacheStats(cacheType *);
+hazardType *hazardOf(int);
+int destReg(int);
+int readsReg(int, int);
+int forward(stateType *, int, int);
+void run(stateType);
+void cycle(stateType *);
+void konataCycle(stateType *, stateType *);
+void konataEnd(stateType *);
+void konataRecord(FILE *, char, int, int, char *);
+void benchmark(stateType *, long long);
+
+int predictNotTaken(predictorType *, int, int);
+void updateNothing(predictorType *, int, int, int);
+int predictOneBit(predictorType *, int, int);
+void updateOneBit(predictorType *, int, int, int);
+int predictTwoBit(predictorType *, int, int);
+void updateTwoBit(predictorType *, int, int, int);
+int predictGshare(predictorType *, int, int);
+void updateGshare(predictorType *, int, int, int);
+int predictTournament(predictorType *, int, int);
+void updateTournament(predictorType *, int, int, int);
+
+predictorEntry predictors[] = {
+	{ "nottaken", predictNotTaken, updateNothing },
+	{ "1bit", predictOneBit, updateOneBit },
+	{ "2bit", predictTwoBit, updateTwoBit },
+	{ "gshare", predictGshare, updateGshare },
+	{ "tournament", predictTournament, updateTournament },
+};
+
+#define NUMPREDICTORS (int)(sizeof(predictors) / sizeof(predictors[0]))
 
 void printState(stateType *statePtr) {
     int i;
-    printf("\n@@@\nstate before cycle %d starts\n", statePtr->cycles);
-    printf("\tpc %d\n", statePtr->pc);
+    traceStr("\n@@@\nstate before cycle ");
+    traceInt(statePtr->cycles);
+    traceStr(" starts\n\tpc ");
+    traceInt(statePtr->pc);
+    traceChar('\n');
 
-    printf("\tdata memory:\n");
+    traceStr("\tdata memory:\n");
 	for (i=0; i<statePtr->numMemory; i++) {
-	    printf("\t\tdataMem[ %d ] %d\n", i, statePtr->dataMem[i]);
+	    traceStr("\t\tdataMem[ ");
+	    traceInt(i);
+	    traceStr(" ] ");
+	    traceInt(statePtr->dataMem[i]);
+	    traceChar('\n');
 	}
-    printf("\tregisters:\n");
+    traceStr("\tregisters:\n");
 	for (i=0; i<NUMREGS; i++) {
-	    printf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
+	    traceStr("\t\treg[ ");
+	    traceInt(i);
+	    traceStr(" ] ");
+	    traceInt(statePtr->reg[i]);
+	    traceChar('\n');
 	}
-    printf("\tIFID:\n");
-	printf("\t\tinstruction ");
+    traceStr("\tIFID:\n");
+	traceStr("\t\tinstruction ");
 	printInstruction(statePtr->IFID.instr);
-	printf("\t\tpcPlus1 %d\n", statePtr->IFID.pcPlus1);
-    printf("\tIDEX:\n");
-	printf("\t\tinstruction ");
+	traceStr("\t\tpcPlus1 ");
+	traceInt(statePtr->IFID.pcPlus1);
+	traceChar('\n');
+    traceStr("\tIDEX:\n");
+	traceStr("\t\tinstruction ");
 	printInstruction(statePtr->IDEX.instr);
-	printf("\t\tpcPlus1 %d\n", statePtr->IDEX.pcPlus1);
-	printf("\t\treadRegA %d\n", statePtr->IDEX.readRegA);
-	printf("\t\treadRegB %d\n", statePtr->IDEX.readRegB);
-	printf("\t\toffset %d\n", statePtr->IDEX.offset);
-    printf("\tEXMEM:\n");
-	printf("\t\tinstruction ");
+	traceStr("\t\tpcPlus1 ");
+	traceInt(statePtr->IDEX.pcPlus1);
+	traceStr("\n\t\treadRegA ");
+	traceInt(statePtr->IDEX.readRegA);
+	traceStr("\n\t\treadRegB ");
+	traceInt(statePtr->IDEX.readRegB);
+	traceStr("\n\t\toffset ");
+	traceInt(statePtr->IDEX.offset);
+	traceChar('\n');
+    traceStr("\tEXMEM:\n");
+	traceStr("\t\tinstruction ");
 	printInstruction(statePtr->EXMEM.instr);
-	printf("\t\tbranchTarget %d\n", statePtr->EXMEM.branchTarget);
-	printf("\t\taluResult %d\n", statePtr->EXMEM.aluResult);
-	printf("\t\treadRegB %d\n", statePtr->EXMEM.readRegB);
-    printf("\tMEMWB:\n");
-	printf("\t\tinstruction ");
+	traceStr("\t\tbranchTarget ");
+	traceInt(statePtr->EXMEM.branchTarget);
+	traceStr("\n\t\taluResult ");
+	traceInt(statePtr->EXMEM.aluResult);
+	traceStr("\n\t\treadRegB ");
+	traceInt(statePtr->EXMEM.readRegB);
+	traceChar('\n');
+    traceStr("\tMEMWB:\n");
+	traceStr("\t\tinstruction ");
 	printInstruction(statePtr->MEMWB.instr);
-	printf("\t\twriteData %d\n", statePtr->MEMWB.writeData);
-    printf("\tWBEND:\n");
-	printf("\t\tinstruction ");
+	traceStr("\t\twriteData ");
+	traceInt(statePtr->MEMWB.writeData);
+	traceChar('\n');
+    traceStr("\tWBEND:\n");
+	traceStr("\t\tinstruction ");
 	printInstruction(statePtr->WBEND.instr);
-	printf("\t\twriteData %d\n", statePtr->WBEND.writeData);
+	traceStr("\t\twriteData ");
+	traceInt(statePtr->WBEND.writeData);
+	traceChar('\n');
 }
 
 int field0(int instruction) {
@@ -143,41 +319,138 @@ void printInstruction(int instr) {
 	} else {
 		strcpy(opcodeString, "data");
     }
-    printf("%s %d %d %d\n", opcodeString, field0(instr), field1(instr), field2(instr));
+    traceStr(opcodeString);
+    traceChar(' ');
+    traceInt(field0(instr));
+    traceChar(' ');
+    traceInt(field1(instr));
+    traceChar(' ');
+    traceInt(field2(instr));
+    traceChar('\n');
     return;
 }
 
 int main(int argc, char *argv[]) {
-    char line[MAXLINELENGTH];
     stateType state;
+    int instrMem[NUMMEMORY];
+    int dataMem[NUMMEMORY];
+    predictorType predictor;
+    predictorEntry *kind = &predictors[0];
+    cacheType icache, dcache;
+    char *icacheGeometry = NULL, *dcacheGeometry = NULL;
+    int missLatency = MISSLATENCY;
+    long long benchCycles = 0;
+    char *konataName = NULL;
+    int stats = 0;
+    char *progName = argv[0];
     FILE *filePtr;
+    int i;
+
+    traceInit();
+
+    /* -p picks the branch predictor, -i and -d add instruction and data
+        caches (blockSize,numSets,blocksPerSet) that take -l cycles per
+        miss, -s prints statistics at halt, -k writes a pipeline viewer
+        log, -b times the pipeline with tracing off instead of printing
+        every cycle */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-s")==0) {
+            stats = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 4)
+            break;
+        if (strcmp(argv[1], "-p")==0) {
+            for (i=0; i<NUMPREDICTORS && strcmp(predictors[i].name, argv[2]); i++)
+                ;
+            if (i == NUMPREDICTORS) {
+                tracePrintf("error: unknown predictor %s\n", argv[2]);
+                traceExit(1);
+            }
+            kind = &predictors[i];
+        } else if (strcmp(argv[1], "-i")==0) {
+            icacheGeometry = argv[2];
+        } else if (strcmp(argv[1], "-d")==0) {
+            dcacheGeometry = argv[2];
+        } else if (strcmp(argv[1], "-l")==0) {
+            missLatency = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-b")==0) {
+            benchCycles = atoll(argv[2]);
+        } else if (strcmp(argv[1], "-k")==0) {
+            konataName = argv[2];
+        } else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
 
     if (argc != 2) {
-        printf("error: usage: %s <machine-code file>\n", argv[0]);
-        exit(1);
+        tracePrintf("error: usage: %s [-p nottaken|1bit|2bit|gshare|tournament] [-i blockSize,numSets,blocksPerSet] [-d blockSize,numSets,blocksPerSet] [-l missLatency] [-s] [-k konataLog] [-b cycles] <machine-code file>\n", progName);
+        traceExit(1);
     }
 
     filePtr = fopen(argv[1], "r");
     if (filePtr == NULL) {
-        printf("error: can't open file %s", argv[1]);
+        tracePrintf("error: can't open file %s", argv[1]);
         perror("fopen");
-        exit(1);
+        traceExit(1);
     }
 
-    /* read in the entire machine-code file into memory */
-    for (state.numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL; state.numMemory++) {
-
-        if (sscanf(line, "%d", state.instrMem+state.numMemory) != 1) {
-            printf("error in reading address %d\n", state.numMemory);
-            exit(1);
+    /* latch fields an instruction doesn't use are printed too; start them at 0 */
+    memset(&state, 0, sizeof(state));
+    memset(instrMem, 0, sizeof(instrMem));
+    memset(dataMem, 0, sizeof(dataMem));
+    state.instrMem = instrMem;
+    state.dataMem = dataMem;
+    state.predictor = &predictor;
+    state.printStats = stats;
+    if (konataName != NULL) {
+        state.konata = fopen(konataName, "w");
+        if (state.konata == NULL) {
+            tracePrintf("error: can't open file %s", konataName);
+            perror("fopen");
+            traceExit(1);
         }
-        state.dataMem[state.numMemory] = state.instrMem[state.numMemory];
+        setvbuf(state.konata, NULL, _IOFBF, 1 << 20);
+        state.konataLabels = calloc(NUMMEMORY, KONATALABEL);
+        if (state.konataLabels == NULL) {
+            tracePrintf("error: out of memory\n");
+            traceExit(1);
+        }
+        fprintf(state.konata, "Kanata\t0004\nC=\t0\n");
+    }
+    if (icacheGeometry != NULL) {
+        initCache(&icache, "instruction", icacheGeometry, missLatency);
+        state.icache = &icache;
     }
+    if (dcacheGeometry != NULL) {
+        initCache(&dcache, "data", dcacheGeometry, missLatency);
+        state.dcache = &dcache;
+    }
+
+    /* counters start weakly not-taken, the chooser weakly trusting local */
+    memset(&predictor, 0, sizeof(predictor));
+    predictor.kind = kind;
+    for (i=0; i<BTBSIZE; i++)
+        predictor.btbPc[i] = -1;
+    memset(predictor.local, 1, sizeof(predictor.local));
+    memset(predictor.global, 1, sizeof(predictor.global));
+    memset(predictor.chooser, 1, sizeof(predictor.chooser));
+
+    /* read in the entire machine-code file (text or binary) into memory */
+    int entry;
+    state.numMemory = loadImage(filePtr, state.instrMem, NUMMEMORY, &entry);
+    fclose(filePtr);
+    if (state.numMemory < 0)
+        traceExit(1);
+    memcpy(state.dataMem, state.instrMem, state.numMemory * sizeof(int));
 
     /* Initialization */
-    state.pc = 0;
+    state.pc = entry;
     state.cycles = 0;
-    int i;
+    state.highestStore = -1;
     for (i = 0; i<NUMREGS; i++)
     	state.reg[i] = 0;
     state.IFID.instr = NOOPINSTRUCTION;
@@ -186,6 +459,15 @@ int main(int argc, char *argv[]) {
     state.MEMWB.instr = NOOPINSTRUCTION;
     state.WBEND.instr = NOOPINSTRUCTION;
 
+    if (benchCycles > 0) {
+        benchmark(&state, benchCycles);
+        if (state.icache != NULL)
+            freeCache(state.icache);
+        if (state.dcache != NULL)
+            freeCache(state.dcache);
+        return 0;
+    }
+
     /* Run */
     run(state);
 
@@ -201,131 +483,560 @@ int convertNum(int num) {
 }
 
 void run(stateType state) {
-	stateType newState;
 	while (1) {
 
 		printState(&state);
 
 		/* check for halt */
 		if (opcode(state.MEMWB.instr) == HALT) {
-			printf("machine halted\n");
-			printf("total of %d cycles executed\n", state.cycles);
-			exit(0);
+			tracePrintf("machine halted\n");
+			tracePrintf("total of %d cycles executed\n", state.cycles);
+			if (state.printStats)
+				printStats(&state);
+			if (state.konata != NULL)
+				konataEnd(&state);
+			if (state.icache != NULL)
+				freeCache(state.icache);
+			if (state.dcache != NULL)
+				freeCache(state.dcache);
+			traceExit(0);
 		}
 
-		newState = state;
-		newState.cycles++;
+		if (state.konata != NULL) {
+			stateType before = state;
+			cycle(&state);
+			konataCycle(&before, &state);
+		} else
+			cycle(&state);
+	}
+}
 
-		/* --------------------- IF stage --------------------- */
-		newState.IFID.pcPlus1 = state.pc + 1;
-		newState.IFID.instr = state.instrMem[state.pc];
-		newState.pc = state.pc + 1;
+/*
+ * CPI splits into base (every cycle nothing was lost), hazard (load-use
+ * stalls and jalr redirects), branch (mispredicts) and memory (cache miss
+ * stalls) components that add up to the whole.
+ */
+void printStats(stateType *statePtr) {
+	predictorType *predictor = statePtr->predictor;
+	int *lost = statePtr->lostCycles;
+	double retired = statePtr->retired > 0 ? statePtr->retired : 1;
+	int i, totalLost = 0;
+	for (i=0; i<NUMCAUSES; i++)
+		totalLost += lost[i];
+
+	tracePrintf("instructions %d\n", statePtr->retired);
+	tracePrintf("CPI %.3f = base %.3f + hazard %.3f + branch %.3f + memory %.3f\n",
+		statePtr->cycles / retired, (statePtr->cycles - totalLost) / retired,
+		(lost[LOADUSE] + lost[JALRFLUSH]) / retired, lost[BRANCHFLUSH] / retired,
+		(lost[ICACHEMISS] + lost[DCACHEMISS]) / retired);
+	for (i=0; i<NUMCAUSES; i++)
+		tracePrintf("cycles lost to %s %d\n", causeNames[i], lost[i]);
+	tracePrintf("%s predictor: %lld branches, %lld mispredicted, accuracy %.2f%%\n",
+		predictor->kind->name, predictor->branches, predictor->mispredicts,
+		predictor->branches > 0 ? 100.0 * (predictor->branches - predictor->mispredicts) / predictor->branches : 100.0);
+	if (statePtr->icache != NULL)
+		printCacheStats(statePtr->icache);
+	if (statePtr->dcache != NULL)
+		printCacheStats(statePtr->dcache);
+}
+
+void printCacheStats(cacheType *cache) {
+	tracePrintf("%s cache: %lld accesses, %lld misses, %lld writebacks, hit rate %.2f%%\n",
+		cache->name, cache->accesses, cache->misses, cache->writebacks,
+		cache->accesses > 0 ? 100.0 * (cache->accesses - cache->misses) / cache->accesses : 100.0);
+}
+
+void initCache(cacheType *cache, char *name, char *geometry, int missLatency) {
+	memset(cache, 0, sizeof(cacheType));
+	cache->name = name;
+	cache->missLatency = missLatency;
+	if (sscanf(geometry, "%d,%d,%d", &cache->blockSize, &cache->numSets, &cache->blocksPerSet) != 3 ||
+			cache->blockSize < 1 || cache->numSets < 1 || cache->blocksPerSet < 1 ||
+			cache->blockSize > NUMMEMORY || missLatency < 0) {
+		tracePrintf("error: bad %s cache %s\n", name, geometry);
+		traceExit(1);
+	}
+	long long ways = (long long)cache->numSets * cache->blocksPerSet;
+	if ((unsigned long long)ways <= ((size_t)-1) / sizeof(int)) {
+		cache->tag = malloc(ways * sizeof(int));
+		cache->dirty = calloc(ways, sizeof(unsigned char));
+		cache->LRUbits = calloc(ways, sizeof(int));
+	}
+	if (cache->tag == NULL || cache->dirty == NULL || cache->LRUbits == NULL) {
+		tracePrintf("error: out of memory for the %s cache\n", name);
+		traceExit(1);
+	}
+	long long i;
+	for (i=0; i<ways; i++)
+		cache->tag[i] = -1;
+}
+
+void freeCache(cacheType *cache) {
+	free(cache->tag);
+	free(cache->dirty);
+	free(cache->LRUbits);
+}
 
-		/* --------------------- ID stage --------------------- */
-		newState.IDEX.instr = state.IFID.instr;
-		newState.IDEX.pcPlus1 = state.IFID.pcPlus1;
-		if (opcode(state.IDEX.instr)==LW) {
-			if (opcode(state.IFID.instr)==LW) {
-				if (field1(state.IDEX.instr)==field0(state.IFID.instr)) {
-					newState.IDEX.instr = NOOPINSTRUCTION;
-					newState.pc = state.pc;
-					newState.IFID.pcPlus1 = state.pc;
-					newState.IFID.instr = state.instrMem[state.pc-1];
-				}
-			} else if (opcode(state.IFID.instr)!=NOOP) {
-				if (field1(state.IDEX.instr)==field0(state.IFID.instr) || field1(state.IDEX.instr)==field1(state.IFID.instr)) {
-					newState.IDEX.instr = NOOPINSTRUCTION;
-					newState.pc = state.pc;
-					newState.IFID.pcPlus1 = state.pc;
-					newState.IFID.instr = state.instrMem[state.pc-1];
-				}
+/*
+ * Look addr up, bringing its block in on a miss, and return how many
+ * cycles the access has to wait: 0 on a hit, one missLatency for the fill
+ * and another if the block it replaces is dirty.
+ */
+int cacheAccess(cacheType *cache, int addr, int write) {
+	int set = (addr / cache->blockSize) % cache->numSets;
+	int tag = addr / (cache->blockSize * cache->numSets);
+	long first = (long)set * cache->blocksPerSet;
+	unsigned char *dirty = &cache->dirty[first];
+	int *tags = &cache->tag[first];
+	int *LRUbits = &cache->LRUbits[first];
+	int i, wait = 0;
+	cache->accesses++;
+
+	int block = -1;
+	for (i=0; i<cache->blocksPerSet && block < 0; i++)
+		if (tags[i]==tag)
+			block = i;
+
+	if (block < 0) {
+		/* miss: an empty block if there is one, else the least recently used */
+		cache->misses++;
+		block = 0;
+		for (i=0; i<cache->blocksPerSet; i++) {
+			if (tags[i] < 0) {
+				block = i;
+				break;
 			}
+			if (LRUbits[i] > LRUbits[block])
+				block = i;
 		}
-		if (opcode(state.IFID.instr)!=NOOP) {
-			newState.IDEX.readRegA = state.reg[field0(state.IFID.instr)];
-			newState.IDEX.readRegB = state.reg[field1(state.IFID.instr)];
-			if (opcode(state.IFID.instr)!=ADD && opcode(state.IFID.instr)!=NAND)
-				newState.IDEX.offset = convertNum(field2(state.IFID.instr));
+		wait = cache->missLatency;
+		if (tags[block] >= 0 && dirty[block]) {
+			cache->writebacks++;
+			wait += cache->missLatency;
 		}
+		dirty[block] = 0;
+		tags[block] = tag;
+	}
 
-		/* --------------------- EX stage --------------------- */
-		newState.EXMEM.instr = state.IDEX.instr;
+	if (write)
+		dirty[block] = 1;
+	for (i=0; i<cache->blocksPerSet; i++)
+		if (tags[i] >= 0 && i != block)
+			LRUbits[i]++;
+	LRUbits[block] = 0;
+	return wait;
+}
 
-		int regA = state.IDEX.readRegA;
-		int regB = state.IDEX.readRegB;
-		if (opcode(state.WBEND.instr)==LW) {
-			if (field0(state.IDEX.instr)==field1(state.WBEND.instr))
-				regA = state.WBEND.writeData;
-			if (field1(state.IDEX.instr)==field1(state.WBEND.instr))
-				regB = state.WBEND.writeData;
-		}
-		if (opcode(state.MEMWB.instr)==LW) {
-			if (field0(state.IDEX.instr)==field1(state.MEMWB.instr))
-				regA = state.MEMWB.writeData;
-			if (field1(state.IDEX.instr)==field1(state.MEMWB.instr))
-				regB = state.MEMWB.writeData;
-		}
-		if (opcode(state.EXMEM.instr)==LW) {
-			if (field0(state.IDEX.instr)==field1(state.EXMEM.instr))
-				regA = state.EXMEM.aluResult;
-			if (field1(state.IDEX.instr)==field1(state.EXMEM.instr))
-				regB = state.EXMEM.aluResult;
+hazardType *hazardOf(int instr) {
+	/* data words executed as code have no sources or destination */
+	if (opcode(instr) < 0 || opcode(instr) > NOOP)
+		return &hazardTable[NOOP];
+	return &hazardTable[opcode(instr)];
+}
+
+/* register instr writes, -1 if none */
+int destReg(int instr) {
+	int destField = hazardOf(instr)->destField;
+	if (destField == 1)
+		return field1(instr);
+	if (destField == 2)
+		return field2(instr);
+	return -1;
+}
+
+int readsReg(int instr, int reg) {
+	hazardType *hazard = hazardOf(instr);
+	return reg >= 0 && ((hazard->readsA && field0(instr)==reg) || (hazard->readsB && field1(instr)==reg));
+}
+
+/*
+ * Value of register reg for the instruction in EX: the newest result
+ * still in the pipeline, else value, what ID read from the register file.
+ */
+int forward(stateType *statePtr, int reg, int value) {
+	if (destReg(statePtr->EXMEM.instr) == reg)
+		return statePtr->EXMEM.aluResult;
+	if (destReg(statePtr->MEMWB.instr) == reg)
+		return statePtr->MEMWB.writeData;
+	if (destReg(statePtr->WBEND.instr) == reg)
+		return statePtr->WBEND.writeData;
+	return value;
+}
+
+/*
+ * Predictors.  predict(pc, history) says whether the beq at pc will be
+ * taken; update(pc, history, taken) trains on its real outcome, with the
+ * same global history the prediction used.
+ */
+int predictNotTaken(predictorType *predictor, int pc, int history) {
+	return 0;
+}
+
+void updateNothing(predictorType *predictor, int pc, int history, int taken) {
+}
+
+int predictOneBit(predictorType *predictor, int pc, int history) {
+	return predictor->local[pc % PHTSIZE] >= 2;
+}
+
+void updateOneBit(predictorType *predictor, int pc, int history, int taken) {
+	predictor->local[pc % PHTSIZE] = taken ? 3 : 0;
+}
+
+void count(unsigned char *counter, int taken) {
+	if (taken && *counter < 3)
+		(*counter)++;
+	else if (!taken && *counter > 0)
+		(*counter)--;
+}
+
+int predictTwoBit(predictorType *predictor, int pc, int history) {
+	return predictor->local[pc % PHTSIZE] >= 2;
+}
+
+void updateTwoBit(predictorType *predictor, int pc, int history, int taken) {
+	count(&predictor->local[pc % PHTSIZE], taken);
+}
+
+int gshareIndex(int pc, int history) {
+	return (pc ^ history) % PHTSIZE;
+}
+
+int predictGshare(predictorType *predictor, int pc, int history) {
+	return predictor->global[gshareIndex(pc, history)] >= 2;
+}
+
+void updateGshare(predictorType *predictor, int pc, int history, int taken) {
+	count(&predictor->global[gshareIndex(pc, history)], taken);
+	predictor->history = ((predictor->history << 1) | taken) & ((1 << HISTORYBITS) - 1);
+}
+
+/* Choose per branch between the 2-bit and gshare predictions */
+int predictTournament(predictorType *predictor, int pc, int history) {
+	if (predictor->chooser[pc % PHTSIZE] >= 2)
+		return predictGshare(predictor, pc, history);
+	return predictTwoBit(predictor, pc, history);
+}
+
+void updateTournament(predictorType *predictor, int pc, int history, int taken) {
+	int localRight = predictTwoBit(predictor, pc, history) == taken;
+	int globalRight = predictGshare(predictor, pc, history) == taken;
+	if (localRight != globalRight)
+		count(&predictor->chooser[pc % PHTSIZE], globalRight);
+	updateTwoBit(predictor, pc, history, taken);
+	updateGshare(predictor, pc, history, taken);
+}
+
+/*
+ * Run the loaded program over and over with tracing off until at least
+ * cycles cycles have been simulated, and report cycles per second.
+ */
+void benchmark(stateType *statePtr, long long cycles) {
+	stateType initial = *statePtr;
+	int *initialData = malloc(NUMMEMORY * sizeof(int));
+	if (initialData == NULL) {
+		tracePrintf("error: out of memory\n");
+		traceExit(1);
+	}
+	memcpy(initialData, statePtr->dataMem, NUMMEMORY * sizeof(int));
+
+	long long done = 0;
+	int runs = 0;
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	while (done < cycles) {
+		/* only words up to the highest store can have changed */
+		int dirty = statePtr->numMemory;
+		if (statePtr->highestStore >= dirty)
+			dirty = statePtr->highestStore + 1;
+		memcpy(statePtr->dataMem, initialData, dirty * sizeof(int));
+		*statePtr = initial;
+
+		while (opcode(statePtr->MEMWB.instr) != HALT)
+			cycle(statePtr);
+		done += statePtr->cycles;
+		runs++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+	tracePrintf("%lld cycles (%d runs) in %.3f s: %.2f million cycles per second\n",
+		done, runs, seconds, seconds > 0 ? done / seconds / 1e6 : 0.0);
+	free(initialData);
+}
+
+/*
+ * Advance the pipeline by one cycle.
+ */
+void cycle(stateType *statePtr) {
+	/* a data cache miss holds the whole pipeline until its block is in */
+	if (statePtr->memWait == 0 && statePtr->dcache != NULL && !statePtr->memAccessed &&
+			(opcode(statePtr->EXMEM.instr)==LW || opcode(statePtr->EXMEM.instr)==SW) &&
+			statePtr->EXMEM.aluResult >= 0 && statePtr->EXMEM.aluResult < NUMMEMORY) {
+		statePtr->memWait = cacheAccess(statePtr->dcache, statePtr->EXMEM.aluResult, opcode(statePtr->EXMEM.instr)==SW);
+		statePtr->memAccessed = 1;
+	}
+	if (statePtr->memWait > 0) {
+		statePtr->memWait--;
+		statePtr->cycles++;
+		statePtr->lostCycles[DCACHEMISS]++;
+		return;
+	}
+
+	stateType state = *statePtr;
+	stateType newState = state;
+	newState.cycles++;
+	newState.memAccessed = 0;
+
+	/* --------------------- IF stage --------------------- */
+	predictorType *predictor = state.predictor;
+	int fetchMissed = 0;
+	if (state.fetchWait == 0) {
+		if (state.icache != NULL && !state.refetching && state.pc >= 0 && state.pc < NUMMEMORY) {
+			newState.fetchWait = cacheAccess(state.icache, state.pc, 0);
+			fetchMissed = newState.fetchWait > 0;
 		}
-		if (opcode(state.WBEND.instr)==ADD || opcode(state.WBEND.instr)==NAND) {
-			if (field0(state.IDEX.instr)==field2(state.WBEND.instr))
-				regA = state.WBEND.writeData;
-			if (field1(state.IDEX.instr)==field2(state.WBEND.instr))
-				regB = state.WBEND.writeData;
+	} else if (state.fetchWait > 1) {
+		fetchMissed = 1;
+		newState.fetchWait--;
+	} else {
+		/* the block is in: fetch without another lookup */
+		newState.fetchWait = 0;
+	}
+	if (fetchMissed) {
+		/* waiting on the instruction cache: send a bubble, fetch pc again */
+		newState.IFID.instr = NOOPINSTRUCTION;
+		newState.IFID.valid = 0;
+	} else {
+		newState.IFID.pcPlus1 = state.pc + 1;
+		newState.IFID.instr = state.instrMem[state.pc];
+		newState.IFID.valid = 1;
+		newState.IFID.id = newState.nextId++;
+		newState.IFID.predictedTaken = 0;
+		newState.pc = state.pc + 1;
+		newState.IFID.history = predictor->history;
+		int btb = state.pc % BTBSIZE;
+		if (predictor->btbPc[btb] == state.pc && predictor->kind->predict(predictor, state.pc, predictor->history)) {
+			newState.IFID.predictedTaken = 1;
+			newState.pc = predictor->btbTarget[btb];
 		}
-		if (opcode(state.MEMWB.instr)==ADD || opcode(state.MEMWB.instr)==NAND) {
-			if (field0(state.IDEX.instr)==field2(state.MEMWB.instr))
-				regA = state.MEMWB.writeData;
-			if (field1(state.IDEX.instr)==field2(state.MEMWB.instr))
-				regB = state.MEMWB.writeData;
+	}
+
+	/* --------------------- ID stage --------------------- */
+	newState.IDEX.instr = state.IFID.instr;
+	newState.IDEX.pcPlus1 = state.IFID.pcPlus1;
+	newState.IDEX.valid = state.IFID.valid;
+	newState.IDEX.id = state.IFID.id;
+	newState.IDEX.predictedTaken = state.IFID.predictedTaken;
+	newState.IDEX.history = state.IFID.history;
+	int stalled = 0;
+	if (hazardOf(state.IDEX.instr)->readyStage > EXSTAGE && readsReg(state.IFID.instr, destReg(state.IDEX.instr))) {
+		/* hold IFID and send a bubble to EX until the result can be forwarded */
+		stalled = 1;
+		newState.IDEX.instr = NOOPINSTRUCTION;
+		newState.IDEX.valid = 0;
+		newState.pc = state.pc;
+		newState.IFID = state.IFID;
+		newState.nextId = state.nextId;
+	}
+	if (opcode(state.IFID.instr)!=NOOP) {
+		newState.IDEX.readRegA = state.reg[field0(state.IFID.instr)];
+		newState.IDEX.readRegB = state.reg[field1(state.IFID.instr)];
+		if (opcode(state.IFID.instr)!=ADD && opcode(state.IFID.instr)!=NAND)
+			newState.IDEX.offset = convertNum(field2(state.IFID.instr));
+	}
+
+	/* --------------------- EX stage --------------------- */
+	newState.EXMEM.instr = state.IDEX.instr;
+	newState.EXMEM.pcPlus1 = state.IDEX.pcPlus1;
+	newState.EXMEM.valid = state.IDEX.valid;
+	newState.EXMEM.id = state.IDEX.id;
+	newState.EXMEM.predictedTaken = state.IDEX.predictedTaken;
+	newState.EXMEM.history = state.IDEX.history;
+
+	int regA = forward(&state, field0(state.IDEX.instr), state.IDEX.readRegA);
+	int regB = forward(&state, field1(state.IDEX.instr), state.IDEX.readRegB);
+
+	newState.EXMEM.readRegB = regB;
+
+	int jalrRedirect = 0;
+	if (opcode(state.IDEX.instr)==ADD)
+		newState.EXMEM.aluResult = regA + regB;
+	else if (opcode(state.IDEX.instr)==NAND)
+		newState.EXMEM.aluResult = ~(regA & regB);
+	else if (opcode(state.IDEX.instr)==BEQ) {
+		newState.EXMEM.aluResult = regB-regA;
+		newState.EXMEM.branchTarget = state.IDEX.pcPlus1 + state.IDEX.offset;
+	} else if (opcode(state.IDEX.instr)==JALR) {
+		/* the return address goes to regB; fetch resumes at regA */
+		jalrRedirect = 1;
+		newState.EXMEM.aluResult = state.IDEX.pcPlus1;
+		newState.pc = JALRTARGET(field0(state.IDEX.instr), field1(state.IDEX.instr), regA, state.IDEX.pcPlus1);
+		newState.fetchWait = 0;
+		newState.IDEX.instr = NOOPINSTRUCTION;
+		newState.IFID.instr = NOOPINSTRUCTION;
+		newState.IDEX.valid = 0;
+		newState.IFID.valid = 0;
+	} else if (opcode(state.IDEX.instr)!=NOOP)
+		newState.EXMEM.aluResult = regA + state.IDEX.offset;
+
+	/* --------------------- MEM stage --------------------- */
+	newState.MEMWB.instr = state.EXMEM.instr;
+	newState.MEMWB.writeData = state.EXMEM.aluResult;
+	newState.MEMWB.valid = state.EXMEM.valid;
+	newState.MEMWB.id = state.EXMEM.id;
+	if (state.EXMEM.valid)
+		newState.retired++;
+	if (opcode(state.EXMEM.instr)==SW) {
+		state.dataMem[state.EXMEM.aluResult] = state.EXMEM.readRegB;
+		if (state.EXMEM.aluResult > newState.highestStore)
+			newState.highestStore = state.EXMEM.aluResult;
+	}
+	if (opcode(state.EXMEM.instr)==LW)
+		newState.MEMWB.writeData = state.dataMem[state.EXMEM.aluResult];
+	int mispredicted = 0;
+	if (opcode(state.EXMEM.instr)==BEQ) {
+		int taken = state.EXMEM.aluResult==0;
+		int branchPc = state.EXMEM.pcPlus1 - 1;
+		predictor->branches++;
+		predictor->kind->update(predictor, branchPc, state.EXMEM.history, taken);
+		if (taken) {
+			predictor->btbPc[branchPc % BTBSIZE] = branchPc;
+			predictor->btbTarget[branchPc % BTBSIZE] = state.EXMEM.branchTarget;
 		}
-		if (opcode(state.EXMEM.instr)==ADD || opcode(state.EXMEM.instr)==NAND) {
-			if (field0(state.IDEX.instr)==field2(state.EXMEM.instr))
-				regA = state.EXMEM.aluResult;
-			if (field1(state.IDEX.instr)==field2(state.EXMEM.instr))
-				regB = state.EXMEM.aluResult;
+
+		/* squash what was fetched down the wrong path */
+		if (taken != state.EXMEM.predictedTaken) {
+			mispredicted = 1;
+			predictor->mispredicts++;
+			newState.pc = taken ? state.EXMEM.branchTarget : state.EXMEM.pcPlus1;
+			newState.fetchWait = 0;
+			newState.IDEX.instr = NOOPINSTRUCTION;
+			newState.IFID.instr = NOOPINSTRUCTION;
+			newState.EXMEM.instr = NOOPINSTRUCTION;
+			newState.IDEX.valid = 0;
+			newState.IFID.valid = 0;
+			newState.EXMEM.valid = 0;
 		}
+	}
 
-		newState.EXMEM.readRegB = regB;
-
-		if (opcode(state.IDEX.instr)==ADD)
-			newState.EXMEM.aluResult = regA + regB;
-		else if (opcode(state.IDEX.instr)==NAND)
-			newState.EXMEM.aluResult = ~(regA & regB);
-		else if (opcode(state.IDEX.instr)==BEQ) {
-			newState.EXMEM.aluResult = regB-regA;
-			newState.EXMEM.branchTarget = state.IDEX.pcPlus1 + state.IDEX.offset;
-		} else if (opcode(state.IDEX.instr)!=NOOP)
-			newState.EXMEM.aluResult = regA + state.IDEX.offset;
-
-		/* --------------------- MEM stage --------------------- */
-		newState.MEMWB.instr = state.EXMEM.instr;
-		newState.MEMWB.writeData = state.EXMEM.aluResult;
-		if (opcode(state.EXMEM.instr)==SW)
-			newState.dataMem[state.EXMEM.aluResult] = state.EXMEM.readRegB;
-		if (opcode(state.EXMEM.instr)==LW)
-			newState.MEMWB.writeData = state.dataMem[state.EXMEM.aluResult];
-		if (opcode(state.EXMEM.instr)==BEQ) {
-			if (state.EXMEM.aluResult==0) {
-				newState.pc = state.EXMEM.branchTarget;
-				newState.IDEX.instr = NOOPINSTRUCTION;
-				newState.IFID.instr = NOOPINSTRUCTION;
-				newState.EXMEM.instr = NOOPINSTRUCTION;
-			}
+	/* --------------------- WB stage --------------------- */
+	newState.WBEND.instr = state.MEMWB.instr;
+	newState.WBEND.writeData = state.MEMWB.writeData;
+	if (destReg(state.MEMWB.instr) >= 0)
+		newState.reg[destReg(state.MEMWB.instr)] = state.MEMWB.writeData;
+
+	/* a squash throws away any stall or redirect behind it */
+	if (mispredicted)
+		newState.lostCycles[BRANCHFLUSH] += 3;
+	else if (jalrRedirect)
+		newState.lostCycles[JALRFLUSH] += 2;
+	else if (stalled)
+		newState.lostCycles[LOADUSE]++;
+	else if (fetchMissed)
+		newState.lostCycles[ICACHEMISS]++;
+	/* a stall with no redirect fetches the same pc again, whose block IF just found */
+	newState.refetching = stalled && !mispredicted && !jalrRedirect && !fetchMissed;
+
+	*statePtr = newState;
+}
+/*
+ * Pipeline viewer log, in the Kanata 0004 format Konata reads.  Called
+ * after every cycle with the state before and after it.  An instruction
+ * fetched during the cycle starts in F then; the log moves on a cycle and
+ * every instruction that reached a new latch starts the stage that latch
+ * feeds (D, X, M, W).  The one that left MEMWB retires, and any that left
+ * IFID, IDEX or EXMEM without reaching the next latch were squashed.
+ */
+void konataCycle(stateType *before, stateType *after) {
+	FILE *log = after->konata;
+	int fetched = after->IFID.valid && after->IFID.id >= before->nextId;
+	int i, j;
+
+	if (fetched) {
+		int pc = after->IFID.pcPlus1 - 1;
+		char *label = after->konataLabels[pc];
+		if (label[0] == '\0') {
+			int instr = after->IFID.instr;
+			snprintf(label, KONATALABEL, "%d: %s %d %d %d", pc,
+				opcode(instr) >= 0 && opcode(instr) <= NOOP ? opcodeNames[opcode(instr)] : "data",
+				field0(instr), field1(instr), field2(instr));
 		}
+		konataRecord(log, 'I', after->IFID.id, after->IFID.id, "0");
+		konataRecord(log, 'L', after->IFID.id, 0, label);
+		konataRecord(log, 'S', after->IFID.id, 0, "F");
+	}
+	fputs("C\t1\n", log);
+
+	if (fetched)
+		konataRecord(log, 'S', after->IFID.id, 0, "D");
+	if (after->IDEX.valid && !(before->IDEX.valid && before->IDEX.id == after->IDEX.id))
+		konataRecord(log, 'S', after->IDEX.id, 0, "X");
+	if (after->EXMEM.valid && !(before->EXMEM.valid && before->EXMEM.id == after->EXMEM.id))
+		konataRecord(log, 'S', after->EXMEM.id, 0, "M");
+	if (after->MEMWB.valid && !(before->MEMWB.valid && before->MEMWB.id == after->MEMWB.id))
+		konataRecord(log, 'S', after->MEMWB.id, 0, "W");
+	if (before->MEMWB.valid && !(after->MEMWB.valid && after->MEMWB.id == before->MEMWB.id))
+		konataRecord(log, 'R', before->MEMWB.id, after->konataRetired++, "0");
+
+	/* stalls: EXMEM held for a data cache miss, IFID held for a load-use hazard */
+	if (before->EXMEM.valid && after->EXMEM.valid && before->EXMEM.id == after->EXMEM.id) {
+		if (before->memWait == 0)
+			konataRecord(log, 'L', after->EXMEM.id, 1, "data cache miss");
+	} else if (before->IFID.valid && after->IFID.valid && before->IFID.id == after->IFID.id)
+		konataRecord(log, 'L', after->IFID.id, 1, "load-use stall");
 
-		/* --------------------- WB stage --------------------- */
-		newState.WBEND.instr = state.MEMWB.instr;
-		newState.WBEND.writeData = state.MEMWB.writeData;
-		if (opcode(state.MEMWB.instr)==LW)
-			newState.reg[field1(state.MEMWB.instr)] = state.MEMWB.writeData;
-		else if (opcode(state.MEMWB.instr)==ADD || opcode(state.MEMWB.instr)==NAND)
-			newState.reg[field2(state.MEMWB.instr)] = state.MEMWB.writeData;
-
-		state = newState;
-	}	
-}
\ No newline at end of file
+	int oldIds[3] = { before->IFID.valid ? before->IFID.id : -1,
+		before->IDEX.valid ? before->IDEX.id : -1, before->EXMEM.valid ? before->EXMEM.id : -1 };
+	int newIds[4] = { after->IFID.valid ? after->IFID.id : -1, after->IDEX.valid ? after->IDEX.id : -1,
+		after->EXMEM.valid ? after->EXMEM.id : -1, after->MEMWB.valid ? after->MEMWB.id : -1 };
+	for (i=0; i<3; i++) {
+		if (oldIds[i] < 0)
+			continue;
+		for (j=0; j<4 && newIds[j] != oldIds[i]; j++)
+			;
+		if (j == 4)
+			konataRecord(log, 'R', oldIds[i], 0, "1");
+	}
+}
+
+/* One "<kind>\t<id>\t<field>\t<text>" line, formatted by hand since there are several a cycle */
+void konataRecord(FILE *log, char kind, int id, int field, char *text) {
+	char line[KONATALABEL + 32];
+	int numbers[2] = { id, field };
+	int length = 0, i;
+	line[length++] = kind;
+	for (i=0; i<2; i++) {
+		char digits[12];
+		int n = 0;
+		unsigned int magnitude = numbers[i] < 0 ? 0u - (unsigned int)numbers[i] : (unsigned int)numbers[i];
+		line[length++] = '\t';
+		do {
+			digits[n++] = '0' + magnitude % 10;
+			magnitude /= 10;
+		} while (magnitude > 0);
+		if (numbers[i] < 0)
+			line[length++] = '-';
+		while (n > 0)
+			line[length++] = digits[--n];
+	}
+	line[length++] = '\t';
+	while (*text != '\0' && length < KONATALABEL + 30)
+		line[length++] = *text++;
+	line[length++] = '\n';
+	fwrite(line, 1, length, log);
+}
+
+/* At halt: retire the halt and drop what was fetched behind it */
+void konataEnd(stateType *statePtr) {
+	FILE *log = statePtr->konata;
+	if (statePtr->IFID.valid)
+		konataRecord(log, 'R', statePtr->IFID.id, 0, "1");
+	if (statePtr->IDEX.valid)
+		konataRecord(log, 'R', statePtr->IDEX.id, 0, "1");
+	if (statePtr->EXMEM.valid)
+		konataRecord(log, 'R', statePtr->EXMEM.id, 0, "1");
+	konataRecord(log, 'R', statePtr->MEMWB.id, statePtr->konataRetired, "0");
+	fclose(log);
+	statePtr->konata = NULL;
+	free(statePtr->konataLabels);
+}
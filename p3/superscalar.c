@@ -0,0 +1,486 @@
+/*
+ * N-wide in-order version of the project 3 pipeline.
+ *
+ * The same five stages and latches as simulate.c, but each latch holds a
+ * group of up to width instructions in program order, lane 0 the oldest.
+ * IF fills a width-entry fetch buffer (IFID) with sequential instructions
+ * and ID issues the longest prefix of it that can go down the pipeline
+ * together; whatever is left moves to the front of the buffer for the next
+ * cycle.  An instruction stays behind when
+ *     - it reads the result of a lw now in EX (load-use, as in simulate.c),
+ *     - it reads a register written by an older instruction in its own
+ *       group, since lanes in EX don't forward to each other, or
+ *     - the group already has memPorts loads and stores.
+ * The register file has two read ports and one write port per lane, and EX
+ * takes each operand from the newest result in any lane of EXMEM, MEMWB or
+ * WBEND.  Branches are predicted not taken and resolve in MEM, where a
+ * taken beq squashes the lanes behind it; jalr redirects from EX.  A halt
+ * ends its fetch group, so nothing younger is ever beside it.
+ *
+ * usage: superscalar [-w width] [-m memPorts] <machine-code file>
+ *
+ * Prints the final state and the achieved IPC instead of a trace per cycle.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mcimage.h"
+#include "trace.h"
+#include "jalr.h"
+#include "hazard.h"
+
+#define NUMMEMORY 65536 /* maximum number of data words in memory */
+#define NUMREGS 8 /* number of machine registers */
+#define MAXWIDTH 8 /* widest group the pipeline can carry */
+
+#define ADD 0
+#define NAND 1
+#define LW 2
+#define SW 3
+#define BEQ 4
+#define JALR 5
+#define HALT 6
+#define NOOP 7
+
+#define NOOPINSTRUCTION 0x1c00000
+
+#define EMPTYBUFFER 0 /* why ID issued less than a full group */
+#define LOADUSE 1
+#define GROUPDEPENDENCE 2
+#define MEMORYPORTS 3
+#define NUMREASONS 4
+
+/* Latches as in simulate.c, one per lane; valid is 0 for bubbles */
+typedef struct IFIDStruct {
+	int instr;
+	int pcPlus1;
+	int valid;
+} IFIDType;
+
+typedef struct IDEXStruct {
+	int instr;
+	int pcPlus1;
+	int readRegA;
+	int readRegB;
+	int offset;
+	int valid;
+} IDEXType;
+
+typedef struct EXMEMStruct {
+	int instr;
+	int branchTarget;
+	int aluResult;
+	int readRegB;
+	int valid;
+} EXMEMType;
+
+typedef struct MEMWBStruct {
+	int instr;
+	int writeData;
+	int valid;
+} MEMWBType;
+
+typedef struct WBENDStruct {
+	int instr;
+	int writeData;
+} WBENDType;
+
+char *reasonNames[NUMREASONS] = { "empty fetch buffer", "load-use", "dependence in group",
+	"memory ports" };
+
+typedef struct stateStruct {
+	int pc;
+	int *instrMem;
+	int *dataMem;
+	int reg[NUMREGS];
+	int numMemory;
+	int width; /* lanes in use, at most MAXWIDTH */
+	int memPorts; /* loads and stores one group may hold */
+	IFIDType IFID[MAXWIDTH];
+	IDEXType IDEX[MAXWIDTH];
+	EXMEMType EXMEM[MAXWIDTH];
+	MEMWBType MEMWB[MAXWIDTH];
+	WBENDType WBEND[MAXWIDTH];
+	int cycles; /* number of cycles run so far */
+	int retired; /* instructions that have left the MEM stage */
+	int issued[MAXWIDTH + 1]; /* cycles ID issued each number of instructions */
+	int shortGroups[NUMREASONS]; /* cycles ID issued less than width, by reason */
+	int branches;
+	int mispredicts;
+} stateType;
+
+void printState(stateType *);
+void printStats(stateType *, char *);
+hazardType *hazardOf(int);
+int destReg(int);
+int readsReg(int, int);
+int loadUse(stateType *, int);
+int forward(stateType *, int, int);
+void run(stateType *, char *);
+void cycle(stateType *);
+int dataAddress(int);
+
+int field0(int instruction) {
+	return( (instruction>>19) & 0x7);
+}
+
+int field1(int instruction) {
+	return( (instruction>>16) & 0x7);
+}
+
+int field2(int instruction) {
+	return(instruction & 0xFFFF);
+}
+
+int opcode(int instruction) {
+	return(instruction>>22);
+}
+
+int convertNum(int num) {
+	/* convert a 16-bit number into a 32-bit integer */
+	if (num & (1 << 15) ) {
+		num -= (1 << 16);
+	}
+	return num;
+}
+
+int main(int argc, char *argv[]) {
+    stateType state;
+    int instrMem[NUMMEMORY];
+    int dataMem[NUMMEMORY];
+    char *progName = argv[0];
+    FILE *filePtr;
+    int i;
+
+    traceInit();
+
+    memset(&state, 0, sizeof(state));
+    state.width = 2;
+    state.memPorts = 1;
+
+    /* -w sets the issue width, -m how many loads and stores one group may hold */
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-w")==0)
+            state.width = atoi(argv[2]);
+        else if (strcmp(argv[1], "-m")==0)
+            state.memPorts = atoi(argv[2]);
+        else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 2 || state.width < 1 || state.width > MAXWIDTH || state.memPorts < 1) {
+        tracePrintf("error: usage: %s [-w width (1-%d)] [-m memPorts] <machine-code file>\n", progName, MAXWIDTH);
+        traceExit(1);
+    }
+
+    filePtr = fopen(argv[1], "r");
+    if (filePtr == NULL) {
+        tracePrintf("error: can't open file %s", argv[1]);
+        perror("fopen");
+        traceExit(1);
+    }
+
+    memset(instrMem, 0, sizeof(instrMem));
+    memset(dataMem, 0, sizeof(dataMem));
+    state.instrMem = instrMem;
+    state.dataMem = dataMem;
+
+    /* read in the entire machine-code file (text or binary) into memory */
+    int entry;
+    state.numMemory = loadImage(filePtr, state.instrMem, NUMMEMORY, &entry);
+    fclose(filePtr);
+    if (state.numMemory < 0)
+        traceExit(1);
+    memcpy(state.dataMem, state.instrMem, state.numMemory * sizeof(int));
+
+    /* Initialization */
+    state.pc = entry;
+    for (i=0; i<MAXWIDTH; i++) {
+        state.IFID[i].instr = NOOPINSTRUCTION;
+        state.IDEX[i].instr = NOOPINSTRUCTION;
+        state.EXMEM[i].instr = NOOPINSTRUCTION;
+        state.MEMWB[i].instr = NOOPINSTRUCTION;
+        state.WBEND[i].instr = NOOPINSTRUCTION;
+    }
+
+    run(&state, argv[1]);
+
+    return 0;
+}
+
+void run(stateType *statePtr, char *fileName) {
+	int i, halt;
+	while (1) {
+		/* check for halt */
+		for (halt=0; halt<statePtr->width && opcode(statePtr->MEMWB[halt].instr)!=HALT; halt++)
+			;
+		if (halt < statePtr->width) {
+			/* the lanes ahead of the halt still write back */
+			for (i=0; i<halt; i++)
+				if (destReg(statePtr->MEMWB[i].instr) >= 0)
+					statePtr->reg[destReg(statePtr->MEMWB[i].instr)] = statePtr->MEMWB[i].writeData;
+			tracePrintf("machine halted\n");
+			tracePrintf("total of %d cycles executed\n", statePtr->cycles);
+			tracePrintf("final state of machine:\n");
+			printState(statePtr);
+			printStats(statePtr, fileName);
+			traceExit(0);
+		}
+
+		cycle(statePtr);
+	}
+}
+
+void printState(stateType *statePtr) {
+	int i;
+	tracePrintf("\tpc %d\n", statePtr->pc);
+	tracePrintf("\tdata memory:\n");
+	for (i=0; i<statePtr->numMemory; i++)
+		tracePrintf("\t\tdataMem[ %d ] %d\n", i, statePtr->dataMem[i]);
+	tracePrintf("\tregisters:\n");
+	for (i=0; i<NUMREGS; i++)
+		tracePrintf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
+}
+
+void printStats(stateType *statePtr, char *fileName) {
+	int i;
+	tracePrintf("%s: width %d, %d memory port%s: %d instructions in %d cycles, IPC %.3f\n",
+		fileName, statePtr->width, statePtr->memPorts, statePtr->memPorts == 1 ? "" : "s",
+		statePtr->retired, statePtr->cycles,
+		statePtr->cycles > 0 ? (double)statePtr->retired / statePtr->cycles : 0.0);
+	tracePrintf("cycles issuing");
+	for (i=0; i<=statePtr->width; i++)
+		tracePrintf(" %d: %d%s", i, statePtr->issued[i], i < statePtr->width ? "," : "\n");
+	tracePrintf("short groups by");
+	for (i=0; i<NUMREASONS; i++)
+		tracePrintf(" %s %d%s", reasonNames[i], statePtr->shortGroups[i], i < NUMREASONS - 1 ? "," : "\n");
+	tracePrintf("%d branches, %d taken (predicted not taken)\n", statePtr->branches, statePtr->mispredicts);
+}
+
+hazardType *hazardOf(int instr) {
+	/* data words executed as code have no sources or destination */
+	if (opcode(instr) < 0 || opcode(instr) > NOOP)
+		return &hazardTable[NOOP];
+	return &hazardTable[opcode(instr)];
+}
+
+/* register instr writes, -1 if none */
+int destReg(int instr) {
+	int destField = hazardOf(instr)->destField;
+	if (destField == 1)
+		return field1(instr);
+	if (destField == 2)
+		return field2(instr);
+	return -1;
+}
+
+int readsReg(int instr, int reg) {
+	hazardType *hazard = hazardOf(instr);
+	return reg >= 0 && ((hazard->readsA && field0(instr)==reg) || (hazard->readsB && field1(instr)==reg));
+}
+
+/*
+ * Whether instr, about to issue, reads a register whose newest value is
+ * being computed in EX by an instruction that won't have it until after MEM.
+ */
+int loadUse(stateType *statePtr, int instr) {
+	int i, j;
+	for (i=0; i<NUMREGS; i++) {
+		if (!readsReg(instr, i))
+			continue;
+		for (j=statePtr->width-1; j>=0 && destReg(statePtr->IDEX[j].instr)!=i; j--)
+			;
+		if (j >= 0 && hazardOf(statePtr->IDEX[j].instr)->readyStage > EXSTAGE)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Value of register reg for an instruction in EX: the newest result still
+ * in the pipeline, else value, what ID read from the register file.  Every
+ * lane of a later latch is older than every lane of an earlier one, and
+ * within a latch the highest lane is the newest.
+ */
+int forward(stateType *statePtr, int reg, int value) {
+	int i;
+	for (i=statePtr->width-1; i>=0; i--)
+		if (destReg(statePtr->EXMEM[i].instr) == reg)
+			return statePtr->EXMEM[i].aluResult;
+	for (i=statePtr->width-1; i>=0; i--)
+		if (destReg(statePtr->MEMWB[i].instr) == reg)
+			return statePtr->MEMWB[i].writeData;
+	for (i=statePtr->width-1; i>=0; i--)
+		if (destReg(statePtr->WBEND[i].instr) == reg)
+			return statePtr->WBEND[i].writeData;
+	return value;
+}
+
+int dataAddress(int addr) {
+	if (addr < 0 || addr >= NUMMEMORY) {
+		tracePrintf("error: data address %d out of range\n", addr);
+		traceExit(1);
+	}
+	return addr;
+}
+
+/*
+ * Advance the pipeline by one cycle.
+ */
+void cycle(stateType *statePtr) {
+	stateType state = *statePtr;
+	stateType newState = state;
+	int width = state.width;
+	int i, j;
+	newState.cycles++;
+
+	/* --------------------- ID stage --------------------- */
+	int issue, memOps = 0, reason = -1;
+	for (issue=0; issue<width && reason < 0; issue++) {
+		int instr = state.IFID[issue].instr;
+		for (j=0; j<issue && !readsReg(instr, destReg(state.IFID[j].instr)); j++)
+			;
+		if (!state.IFID[issue].valid)
+			reason = EMPTYBUFFER;
+		else if (loadUse(&state, instr))
+			reason = LOADUSE;
+		else if (j < issue)
+			reason = GROUPDEPENDENCE;
+		else if ((opcode(instr)==LW || opcode(instr)==SW) && memOps++ == state.memPorts)
+			reason = MEMORYPORTS;
+	}
+	if (reason >= 0) {
+		issue--;
+		newState.shortGroups[reason]++;
+	}
+	newState.issued[issue]++;
+
+	for (i=0; i<width; i++) {
+		IDEXType *idex = &newState.IDEX[i];
+		int instr = state.IFID[i].instr;
+		if (i >= issue) {
+			memset(idex, 0, sizeof(IDEXType));
+			idex->instr = NOOPINSTRUCTION;
+			continue;
+		}
+		idex->instr = instr;
+		idex->pcPlus1 = state.IFID[i].pcPlus1;
+		idex->valid = 1;
+		idex->readRegA = state.reg[field0(instr)];
+		idex->readRegB = state.reg[field1(instr)];
+		idex->offset = convertNum(field2(instr));
+	}
+
+	/* what didn't issue moves to the front of the fetch buffer */
+	int kept = 0;
+	for (i=issue; i<width && state.IFID[i].valid; i++)
+		newState.IFID[kept++] = state.IFID[i];
+
+	/* --------------------- IF stage --------------------- */
+	/* fill the rest of the buffer, stopping after a halt */
+	int fetching = kept == 0 || opcode(newState.IFID[kept - 1].instr) != HALT;
+	for (i=kept; i<width; i++) {
+		IFIDType *ifid = &newState.IFID[i];
+		if (fetching && newState.pc >= 0 && newState.pc < NUMMEMORY) {
+			ifid->instr = state.instrMem[newState.pc];
+			ifid->pcPlus1 = newState.pc + 1;
+			ifid->valid = 1;
+			newState.pc++;
+			fetching = opcode(ifid->instr) != HALT;
+		} else {
+			ifid->instr = NOOPINSTRUCTION;
+			ifid->valid = 0;
+		}
+	}
+
+	/* --------------------- EX stage --------------------- */
+	int redirected = 0;
+	for (i=0; i<width; i++) {
+		IDEXType *idex = &state.IDEX[i];
+		EXMEMType *exmem = &newState.EXMEM[i];
+		memset(exmem, 0, sizeof(EXMEMType));
+		exmem->instr = NOOPINSTRUCTION;
+		if (redirected || !idex->valid)
+			continue;
+		exmem->instr = idex->instr;
+		exmem->valid = 1;
+
+		int regA = forward(&state, field0(idex->instr), idex->readRegA);
+		int regB = forward(&state, field1(idex->instr), idex->readRegB);
+		exmem->readRegB = regB;
+
+		if (opcode(idex->instr)==ADD)
+			exmem->aluResult = regA + regB;
+		else if (opcode(idex->instr)==NAND)
+			exmem->aluResult = ~(regA & regB);
+		else if (opcode(idex->instr)==BEQ) {
+			exmem->aluResult = regB-regA;
+			exmem->branchTarget = idex->pcPlus1 + idex->offset;
+		} else if (opcode(idex->instr)==JALR) {
+			/* the return address goes to regB; fetch resumes at regA */
+			exmem->aluResult = idex->pcPlus1;
+			newState.pc = JALRTARGET(field0(idex->instr), field1(idex->instr), regA, idex->pcPlus1);
+			for (j=0; j<width; j++) {
+				newState.IDEX[j].instr = NOOPINSTRUCTION;
+				newState.IDEX[j].valid = 0;
+				newState.IFID[j].instr = NOOPINSTRUCTION;
+				newState.IFID[j].valid = 0;
+			}
+			redirected = 1;
+		} else if (opcode(idex->instr)!=NOOP)
+			exmem->aluResult = regA + idex->offset;
+	}
+
+	/* --------------------- MEM stage --------------------- */
+	int squashing = 0;
+	for (i=0; i<width; i++) {
+		EXMEMType *exmem = &state.EXMEM[i];
+		MEMWBType *memwb = &newState.MEMWB[i];
+		if (squashing || !exmem->valid) {
+			memwb->instr = NOOPINSTRUCTION;
+			memwb->writeData = 0;
+			memwb->valid = 0;
+			continue;
+		}
+		memwb->instr = exmem->instr;
+		memwb->writeData = exmem->aluResult;
+		memwb->valid = 1;
+		newState.retired++;
+		if (opcode(exmem->instr)==SW)
+			state.dataMem[dataAddress(exmem->aluResult)] = exmem->readRegB;
+		if (opcode(exmem->instr)==LW)
+			memwb->writeData = state.dataMem[dataAddress(exmem->aluResult)];
+		if (opcode(exmem->instr)==BEQ) {
+			newState.branches++;
+			if (exmem->aluResult==0) {
+				/* taken: squash everything behind it, in this group and after */
+				newState.mispredicts++;
+				newState.pc = exmem->branchTarget;
+				for (j=0; j<width; j++) {
+					newState.EXMEM[j].instr = NOOPINSTRUCTION;
+					newState.EXMEM[j].valid = 0;
+					newState.IDEX[j].instr = NOOPINSTRUCTION;
+					newState.IDEX[j].valid = 0;
+					newState.IFID[j].instr = NOOPINSTRUCTION;
+					newState.IFID[j].valid = 0;
+				}
+				squashing = 1;
+			}
+		}
+	}
+
+	/* --------------------- WB stage --------------------- */
+	/* lanes write in program order, so the newest result wins */
+	for (i=0; i<width; i++) {
+		newState.WBEND[i].instr = state.MEMWB[i].instr;
+		newState.WBEND[i].writeData = state.MEMWB[i].writeData;
+		if (destReg(state.MEMWB[i].instr) >= 0)
+			newState.reg[destReg(state.MEMWB[i].instr)] = state.MEMWB[i].writeData;
+	}
+
+	*statePtr = newState;
+}
@@ -0,0 +1,15 @@
+	lw	0	1	tgt	r1 = address of skip
+	jalr	1	1		r1 = 2, and jumps to 2, not to skip
+	lw	0	2	one
+	add	2	2	2
+	lw	0	4	subAdr
+	jalr	4	7		call sub, r7 = 6
+	add	2	3	2
+	halt
+skip	lw	0	3	one	never reached
+	halt
+sub	add	2	2	3
+	jalr	7	6		return
+tgt	.fill	skip
+one	.fill	1
+subAdr	.fill	sub
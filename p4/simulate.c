@@ -5,12 +5,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "mcimage.h"
+#include "trace.h"
 
 #define NUMMEMORY 65536 /* maximum number of words in memory */
 #define NUMREGS 8 /* number of machine registers */
 #define MAXLINELENGTH 1000
-#define MAXBLOCKSIZE 256
-#define MAXBLOCKS 256
+#define RPTSIZE 64 /* stride prefetcher table entries */
+#define NUMSTREAMS 8 /* streams the stream prefetcher follows */
+#define FILTERSIZE 256 /* blocks remembered as thrown out by prefetches */
+#define TRACEMAGIC "lc2kaddr" /* first bytes of an address trace */
+#define MAXTHREADS 256 /* sweep workers */
 
 #define ADD 0
 #define NAND 1
@@ -21,56 +32,342 @@
 #define HALT 6
 #define NOOP 7
 
+/*
+ * The memory bus: the words moved each way, a clock counting the cycles
+ * accesses have waited so far, and an optional coalescing write buffer in
+ * front of memory.  The buffer holds up to depth
+ * entries, oldest first, each one aligned block of blockSize words with
+ * a valid bit per word; writes to a block already waiting merge into its
+ * entry, and a write that finds the buffer full first drains the oldest.
+ */
+typedef struct memoryStruct {
+	int latency; /* cycles for memory to answer a read */
+	long long cycles; /* time spent waiting on the memory system */
+	int depth; /* entries, 0 for no buffer */
+	int blockSize; /* words per entry */
+	int numEntries;
+	int *addr; /* per entry */
+	int *data; /* blockSize words per entry */
+	unsigned char *valid; /* per word */
+	long long wordsRead;
+	long long wordsWritten;
+	long long coalesced; /* writes that merged into a waiting entry */
+	long long fullStalls; /* writes that had to wait for a drain */
+} busType;
+
+/*
+ * Stack distance profile for the all-geometries mode: every power of two
+ * block size and set count up to the ones asked for, which must be powers
+ * of two themselves, each with an LRU stack per set of the last maxWays
+ * blocks referenced there, most recent first.  A reference found at depth
+ * d hits in every cache of that block size and set count with more than d
+ * ways, so one pass gives the miss rate of every associativity too; the
+ * powers of two are printed, and maxWays.
+ */
+typedef struct profileStruct {
+	int numSizes; /* block sizes 1, 2, 4, ... */
+	int numSetCounts; /* set counts 1, 2, 4, ... */
+	int maxWays;
+	int *offset; /* per block size and set count: where its stacks start */
+	int *stacks; /* maxWays block numbers per set, -1 if empty */
+	long long *hits; /* per block size, set count and depth */
+	long long references;
+} profileType;
+
 typedef struct stateStruct {
     int pc;
     int mem[NUMMEMORY];
     int reg[NUMREGS];
     int numMemory;
+    busType *bus;
+    profileType *profile; /* all-geometries mode, else NULL */
+    struct sweepStruct *sweep; /* sweep mode, else NULL */
+    FILE *recording; /* address trace being written, else NULL */
+    int quiet; /* leave the transfers out of the trace */
+    int lastRecorded[3]; /* by kind of reference */
 } stateType;
 
-typedef struct setStruct {
-	int dirty[MAXBLOCKSIZE];
-	int valid[MAXBLOCKSIZE];
-	int tag[MAXBLOCKSIZE];
-	int data[MAXBLOCKSIZE];
-	int LRUbits[MAXBLOCKSIZE];
-	int LRU;
-} setType;
+/*
+ * Address traces.  After the magic bytes each reference is one record: a
+ * first byte holding the kind in its top two bits, a continuation flag and
+ * the low five bits of the address's change since the last reference of
+ * the same kind, zigzag coded so small steps either way stay small; the
+ * rest of the change follows seven bits a byte, low first, the top bit of
+ * each byte set while more follow.  Sequential fetches and strided data
+ * thus take one byte each.  Stored values are not kept.
+ */
+enum referenceKind {
+	fetchReference, loadReference, storeReference
+};
 
+/*
+ * Cache storage, sized to the geometry and laid out by way: way w of set s
+ * is entry s * blocksPerSet + w of each per-way array, and its words start
+ * at data[(s * blocksPerSet + w) * blockSize].  The tags of a set sit
+ * together away from the data, with -1 marking an invalid way, so a lookup
+ * reads only the set's tags.  Replacement bookkeeping is kept the same way:
+ * the LRU policy keeps each set's ways on a doubly linked list from most to
+ * least recently used, tree-PLRU and RRIP keep theirs in bits, and FIFO the
+ * way to replace next.
+ */
 typedef struct cacheStruct {
-	setType sets[MAXBLOCKS];
-	int SIZE;
 	int blockSize;
     int numSets;
     int blocksPerSet;
+	int *tag; /* per way, -1 if invalid */
+	unsigned char *dirty; /* per way */
+	int *data; /* blockSize words per way */
+	int *older; /* per way: LRU list links, -1 at the ends */
+	int *newer;
+	int *mru; /* per set */
+	int *lru;
+	int *bits; /* per way: tree-PLRU nodes, RRIP re-reference predictions */
+	int *nextFill; /* per set: FIFO */
+	unsigned char *prefetched; /* per way: 1 + the kind of access whose prefetcher brought it in, 0 once used */
+	long long *readyAt; /* per way: when a prefetched block arrives */
+	struct replacementStruct *policy;
+	struct prefetcherStruct *prefetcher[2]; /* by kind of access, NULL for none */
+	unsigned int seed; /* random replacement */
+	char name[16]; /* as printed in transfers: "cache", or "L1D", "L2", ... */
+	int latency; /* hit time in cycles */
+	int inclusion; /* of the levels above this one */
+	int writeThrough; /* pass every write down rather than marking blocks dirty */
+	int writeAllocate; /* bring the block in on a write miss */
+	struct cacheStruct *next; /* the level below, NULL for memory */
+	struct cacheStruct *upper[2]; /* the levels above, two under a split L1 */
+	int numUpper;
+	struct cacheStruct *sibling; /* the other half of a split L1 */
+	long long accesses; /* requests from the processor or the level above */
+	long long misses;
+	long long writebacks; /* dirty blocks sent to the level below */
+	int printStats; /* print the counts above at halt */
 } cacheType;
 
-enum actionType {
-	cacheToProcessor, processorToCache, memoryToCache, cacheToMemory, cacheToNowhere
+/*
+ * How a level relates to the levels above it.  A non-inclusive level is
+ * filled on the way up but evicts without looking above; an inclusive one
+ * also invalidates its victims in the levels above; an exclusive one holds
+ * only what the levels above have evicted, handing a block up on a hit.
+ */
+enum inclusionType {
+	nonInclusive, inclusive, exclusive
+};
+
+char *inclusionNames[] = { "noninclusive", "inclusive", "exclusive" };
+
+/*
+ * Replacement policies.  Misses fill the lowest invalid way first; once a
+ * set is full, victim() picks the way to evict.  insert() is called for
+ * every block brought in and touch() for every hit.
+ */
+typedef struct replacementStruct {
+	char *name;
+	void (*reset)(cacheType *, int);
+	void (*insert)(cacheType *, int, int);
+	void (*touch)(cacheType *, int, int);
+	int (*victim)(cacheType *, int);
+} replacementEntry;
+
+/*
+ * Prefetchers.  Each kind of access, instruction fetches and data
+ * accesses, can have a prefetcher of its own; access() sees every demand
+ * access of its kind and miss() every demand miss, and either may bring
+ * blocks in with prefetchBlock().  Blocks so brought in are tagged until
+ * first used, so the prefetcher can be credited with them, and the blocks
+ * they evict are remembered to catch the misses that causes.
+ */
+enum accessKind {
+	instructionAccess, dataAccess
 };
 
+char *accessNames[] = { "instructions", "data" };
+
+enum strideState {
+	initial, transient, steady, noPrediction
+};
+
+typedef struct prefetcherStruct {
+	struct prefetchPolicyStruct *policy;
+	int kind;
+	int degree; /* blocks fetched ahead */
+	/* stride: reference prediction table indexed by pc */
+	int rptPc[RPTSIZE]; /* -1 if empty */
+	int rptLast[RPTSIZE];
+	int rptStride[RPTSIZE];
+	int rptState[RPTSIZE];
+	/* stream: last block of each stream, its direction (0 while training) and how far ahead it has fetched */
+	int streamLast[NUMSTREAMS];
+	int streamDir[NUMSTREAMS];
+	int streamAhead[NUMSTREAMS];
+	long long streamUsed[NUMSTREAMS];
+	long long stamp;
+	int evicted[FILTERSIZE]; /* block numbers, -1 if empty */
+	long long issued;
+	long long useful; /* prefetched blocks later used */
+	long long late; /* used before they arrived */
+	long long pollution; /* misses on blocks a prefetch threw out */
+	long long demandMisses;
+} prefetcherType;
+
+typedef struct prefetchPolicyStruct {
+	char *name;
+	void (*access)(cacheType *, prefetcherType *, int, int, stateType *);
+	void (*miss)(cacheType *, prefetcherType *, int, int, stateType *);
+} prefetchEntry;
+
+/*
+ * Design-space sweep.  The run only collects its references, each stored
+ * as kind * NUMMEMORY + address; at halt every combination of the chosen
+ * policies and the powers of two between low and high of each geometry
+ * field is simulated by a pool of worker threads.  The references are
+ * shared and only read.  Each worker has a quiet state, bus and cache of
+ * its own for the configuration it is on, and writes only that
+ * configuration's result.  A worker can't end the run with an error, so
+ * the ranges are checked before any reference is collected, and the
+ * largest configuration is built once before the workers start.
+ */
+typedef struct sweepResultStruct {
+	int policy; /* index in policies[] */
+	int blockSize;
+	int numSets;
+	int blocksPerSet;
+	long long accesses;
+	long long misses;
+	long long writebacks;
+	long long wordsRead;
+	long long wordsWritten;
+	double accessTime;
+} sweepResultType;
+
+typedef struct sweepStruct {
+	int low[3]; /* block size, sets, ways */
+	int high[3];
+	int top[3]; /* the largest of each that doubling from low reaches */
+	int policies; /* bit per entry of policies[] */
+	int latency;
+	int memoryLatency;
+	int writeThrough;
+	int writeAllocate;
+	int bufferDepth;
+	int numThreads;
+	int *references;
+	long long numReferences;
+	long long capacity;
+	sweepResultType *results;
+	int numResults;
+	int nextResult; /* next configuration a worker takes, guarded by lock */
+	stateType *states; /* one quiet state per worker */
+	int nextState; /* next state a starting worker takes, guarded by lock */
+	pthread_mutex_t lock;
+} sweepType;
+
 void printState(stateType *);
-void run(cacheType, stateType);
+void initProfile(profileType *, int, int, int);
+void profileReference(profileType *, int);
+void printProfile(profileType *);
+int nextWays(int, int);
+void parseRange(char *, int *, int *);
+void collectReference(sweepType *, int, int);
+void runSweep(sweepType *);
+void *sweepWorker(void *);
+void run(cacheType *, cacheType *, stateType);
+void replay(cacheType *, cacheType *, stateType *, char *);
+void halt(cacheType *, cacheType *, stateType *);
+void recordReference(stateType *, int, int);
 int convertNum(int);
-void printAction(int, int, enum actionType);
+void printAction(stateType *, int, int, char *, char *);
+void printStats(cacheType *, cacheType *, busType *);
+double averageAccessTime(cacheType *, busType *);
+void initCache(cacheType *, int, int, int);
+void freeCache(cacheType *);
+void *allocate(long long, size_t);
+int wordsInMemory(int, int);
+void parseGeometry(char *, int *, int);
 
-void adjustLRU(cacheType *, int, int);
+int lookupBlock(cacheType *, int);
+int findBlock(cacheType *, int, stateType *);
+int fillBlock(cacheType *, int, int, stateType *);
+void evict(cacheType *, int, stateType *);
+int fetchBlock(cacheType *, int, int, int *, char *, stateType *);
+void writeBlock(cacheType *, int, int, int *, int, char *, stateType *);
+int invalidateRange(cacheType *, int, int, int *, char *, stateType *);
+void cleanSibling(cacheType *, int, stateType *);
+void writeWord(cacheType *, int, int, char *, stateType *);
+void initBus(busType *, int, int, int);
+void readMemory(int, int, int *, stateType *);
+void writeMemory(int, int, int *, char *, stateType *);
+void drainEntry(stateType *);
+int fetch(cacheType *, int, stateType *);
 int load(cacheType *, int, stateType *);
 void store(cacheType *, int, int, stateType *);
 
+prefetcherType *newPrefetcher(char *, int);
+void printPrefetcher(prefetcherType *);
+int notePrefetches(cacheType *, int, int, stateType *);
+void trainPrefetcher(cacheType *, int, int, int, int, stateType *);
+void prefetchBlock(cacheType *, prefetcherType *, int, stateType *);
+void prefetchNothing(cacheType *, prefetcherType *, int, int, stateType *);
+void missNextLine(cacheType *, prefetcherType *, int, int, stateType *);
+void accessStride(cacheType *, prefetcherType *, int, int, stateType *);
+void accessStream(cacheType *, prefetcherType *, int, int, stateType *);
+void missStream(cacheType *, prefetcherType *, int, int, stateType *);
+void advanceStream(cacheType *, prefetcherType *, int, int, stateType *);
+
+void resetLRU(cacheType *, int);
+void touchLRU(cacheType *, int, int);
+int victimLRU(cacheType *, int);
+void resetPLRU(cacheType *, int);
+void touchPLRU(cacheType *, int, int);
+int victimPLRU(cacheType *, int);
+void resetFIFO(cacheType *, int);
+void touchNothing(cacheType *, int, int);
+int victimFIFO(cacheType *, int);
+void resetNothing(cacheType *, int);
+int victimRandom(cacheType *, int);
+void resetRRIP(cacheType *, int);
+void insertRRIP(cacheType *, int, int);
+void touchRRIP(cacheType *, int, int);
+int victimRRIP(cacheType *, int);
+
+replacementEntry policies[] = {
+	{ "lru", resetLRU, touchLRU, touchLRU, victimLRU },
+	{ "plru", resetPLRU, touchPLRU, touchPLRU, victimPLRU },
+	{ "fifo", resetFIFO, touchNothing, touchNothing, victimFIFO },
+	{ "random", resetNothing, touchNothing, touchNothing, victimRandom },
+	{ "rrip", resetRRIP, insertRRIP, touchRRIP, victimRRIP },
+};
+
+#define NUMPOLICIES (int)(sizeof(policies) / sizeof(policies[0]))
+
+prefetchEntry prefetchers[] = {
+	{ "nextline", prefetchNothing, missNextLine },
+	{ "stride", accessStride, prefetchNothing },
+	{ "stream", accessStream, missStream },
+};
+
+#define NUMPREFETCHERS (int)(sizeof(prefetchers) / sizeof(prefetchers[0]))
+
 void printState(stateType *statePtr) {
     int i;
-    printf("\n@@@\nstate:\n");
-    printf("\tpc %d\n", statePtr->pc);
-    printf("\tmemory:\n");
+    traceStr("\n@@@\nstate:\n\tpc ");
+    traceInt(statePtr->pc);
+    traceStr("\n\tmemory:\n");
 	for (i=0; i<statePtr->numMemory; i++) {
-	    printf("\t\tmem[ %d ] %d\n", i, statePtr->mem[i]);
+	    traceStr("\t\tmem[ ");
+	    traceInt(i);
+	    traceStr(" ] ");
+	    traceInt(statePtr->mem[i]);
+	    traceChar('\n');
 	}
-    printf("\tregisters:\n");
+    traceStr("\tregisters:\n");
 	for (i=0; i<NUMREGS; i++) {
-	    printf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
+	    traceStr("\t\treg[ ");
+	    traceInt(i);
+	    traceStr(" ] ");
+	    traceInt(statePtr->reg[i]);
+	    traceChar('\n');
 	}
-    printf("end state\n");
+    traceStr("end state\n");
 }
 
 int convertNum(int num) {
@@ -86,192 +383,1412 @@ int convertNum(int num) {
  *
  * address is the starting word address of the range of data being transferred.
  * size is the size of the range of data being transferred.
- * type specifies the source and destination of the data being transferred.
- * 	cacheToProcessor: reading data from the cache to the processor
- * 	processorToCache: writing data from the processor to the cache
- * 	memoryToCache: reading data from the memory to the cache
- * 	cacheToMemory: evicting cache data by writing it to the memory
- * 	cacheToNowhere: evicting cache data by throwing it away
- */
-void printAction(int address, int size, enum actionType type) {
-    printf("@@@ transferring word [%d-%d] ", address, address + size - 1);
-    if (type == cacheToProcessor) {
-        printf("from the cache to the processor\n");
-    } else if (type == processorToCache) {
-        printf("from the processor to the cache\n");
-    } else if (type == memoryToCache) {
-        printf("from the memory to the cache\n");
-    } else if (type == cacheToMemory) {
-        printf("from the cache to the memory\n");
-    } else if (type == cacheToNowhere) {
-        printf("from the cache to nowhere\n");
+ * source and destination name where the data comes from and goes to:
+ * "processor", "memory" or the name of a cache level.  A NULL destination
+ * means the data is thrown away.  With a single cache the transfers are
+ * 	cache to processor: reading data from the cache to the processor
+ * 	processor to cache: writing data from the processor to the cache
+ * 	memory to cache: reading data from the memory to the cache
+ * 	cache to memory: evicting cache data by writing it to the memory
+ * 	cache to nowhere: evicting cache data by throwing it away
+ * A quiet state prints nothing, and only the words in memory are listed.
+ */
+void printAction(stateType *state, int address, int size, char *source, char *destination) {
+    if (state->quiet)
+        return;
+    size = wordsInMemory(address, size);
+    traceStr("@@@ transferring word [");
+    traceInt(address);
+    traceChar('-');
+    traceInt(address + size - 1);
+    traceStr("] from the ");
+    traceStr(source);
+    if (destination == NULL) {
+        traceStr(" to nowhere\n");
+    } else {
+        traceStr(" to the ");
+        traceStr(destination);
+        traceChar('\n');
     }
 }
 
-void adjustLRU(cacheType *cache, int set, int i) {
-	cache->sets[set].LRUbits[i] = 0;
-	int j;
-	for (j=0; j<cache->blocksPerSet; j++) {
-		if (cache->sets[set].valid[j]==1 && i!=j)
-			cache->sets[set].LRUbits[j]++;
+/*
+ * Memory traffic, counts for every level, then the average memory access
+ * time.  A single unified cache keeps its one-line summary.
+ */
+void printStats(cacheType *icache, cacheType *dcache, busType *bus) {
+	cacheType *level;
+	tracePrintf("memory traffic: %lld words read, %lld words written\n", bus->wordsRead, bus->wordsWritten);
+	if (bus->depth > 0)
+		tracePrintf("write buffer: %d entries of %d words, %lld writes coalesced, %lld stalled full\n",
+			bus->depth, bus->blockSize, bus->coalesced, bus->fullStalls);
+	if (icache->prefetcher[instructionAccess] != NULL)
+		printPrefetcher(icache->prefetcher[instructionAccess]);
+	if (dcache->prefetcher[dataAccess] != NULL)
+		printPrefetcher(dcache->prefetcher[dataAccess]);
+	if (icache == dcache && dcache->next == NULL) {
+		tracePrintf("%s replacement: %lld accesses, %lld misses, %lld writebacks, hit rate %.2f%%\n",
+			dcache->policy->name, dcache->accesses, dcache->misses, dcache->writebacks,
+			dcache->accesses > 0 ? 100.0 * (dcache->accesses - dcache->misses) / dcache->accesses : 100.0);
+		return;
+	}
+
+	for (level = (icache != dcache) ? icache : dcache; level != NULL;
+			level = (level == icache && icache != dcache) ? dcache : level->next) {
+		tracePrintf("%s: %lld accesses, %lld misses, %lld writebacks, hit rate %.2f%%, %d cycles\n",
+			level->name, level->accesses, level->misses, level->writebacks,
+			level->accesses > 0 ? 100.0 * (level->accesses - level->misses) / level->accesses : 100.0,
+			level->latency);
+	}
+
+	double amat = averageAccessTime(dcache, bus);
+	if (icache != dcache && icache->accesses + dcache->accesses > 0)
+		amat = (icache->accesses * averageAccessTime(icache, bus) + dcache->accesses * amat) /
+			(icache->accesses + dcache->accesses);
+	tracePrintf("%s replacement, %s: average memory access time %.2f cycles\n",
+		dcache->policy->name, inclusionNames[dcache->next ? dcache->next->inclusion : nonInclusive], amat);
+}
+
+/* hit time plus the local miss rate times the time to serve a miss below */
+double averageAccessTime(cacheType *cache, busType *bus) {
+	double missRate = cache->accesses > 0 ? (double)cache->misses / cache->accesses : 0.0;
+	double missTime = cache->next ? averageAccessTime(cache->next, bus) : bus->latency;
+	return cache->latency + missRate * missTime;
+}
+
+/*
+ * Allocate and empty a cache of the given geometry.  The policy, and
+ * whether to print statistics, are already set.
+ */
+void initCache(cacheType *cache, int blockSize, int numSets, int blocksPerSet) {
+	if (blockSize < 1 || numSets < 1 || blocksPerSet < 1) {
+		tracePrintf("error: blockSizeInWords, numberOfSets and blocksPerSet must be positive\n");
+		traceExit(1);
+	}
+	if (blockSize > NUMMEMORY) {
+		tracePrintf("error: blockSizeInWords must be at most %d\n", NUMMEMORY);
+		traceExit(1);
 	}
+	if (cache->policy->victim == victimPLRU && (blocksPerSet & (blocksPerSet - 1)) != 0) {
+		tracePrintf("error: plru needs a power of two blocksPerSet\n");
+		traceExit(1);
+	}
+	cache->blockSize = blockSize;
+	cache->numSets = numSets;
+	cache->blocksPerSet = blocksPerSet;
+	long long ways = (long long)numSets * blocksPerSet;
+	cache->tag = allocate(ways, sizeof(int));
+	cache->dirty = allocate(ways, sizeof(unsigned char));
+	cache->data = allocate(ways * blockSize, sizeof(int));
+	cache->older = allocate(ways, sizeof(int));
+	cache->newer = allocate(ways, sizeof(int));
+	cache->bits = allocate(ways, sizeof(int));
+	cache->mru = allocate(numSets, sizeof(int));
+	cache->lru = allocate(numSets, sizeof(int));
+	cache->nextFill = allocate(numSets, sizeof(int));
+	cache->prefetched = allocate(ways, sizeof(unsigned char));
+	cache->readyAt = allocate(ways, sizeof(long long));
+	cache->prefetcher[instructionAccess] = NULL;
+	cache->prefetcher[dataAccess] = NULL;
+	cache->seed = 370;
+	strcpy(cache->name, "cache");
+	cache->latency = 1;
+	cache->inclusion = nonInclusive;
+	cache->writeThrough = 0;
+	cache->writeAllocate = 1;
+	cache->next = NULL;
+	cache->numUpper = 0;
+	cache->sibling = NULL;
+	cache->accesses = 0;
+	cache->misses = 0;
+	cache->writebacks = 0;
+
+	long long i;
+	for (i=0; i<ways; i++)
+		cache->tag[i] = -1;
+	for (i=0; i<numSets; i++)
+		cache->policy->reset(cache, i);
 }
 
-/**
- * Properly simulates the cache for a load from
- * memory address “addr”. Returns the loaded value.
+void freeCache(cacheType *cache) {
+	free(cache->tag);
+	free(cache->dirty);
+	free(cache->data);
+	free(cache->older);
+	free(cache->newer);
+	free(cache->bits);
+	free(cache->mru);
+	free(cache->lru);
+	free(cache->nextFill);
+	free(cache->prefetched);
+	free(cache->readyAt);
+	free(cache->prefetcher[instructionAccess]);
+	free(cache->prefetcher[dataAccess]);
+}
+
+/* an empty bus, buffering up to depth blocks of blockSize words */
+void initBus(busType *bus, int latency, int depth, int blockSize) {
+	bus->latency = latency;
+	bus->cycles = 0;
+	bus->depth = depth;
+	bus->blockSize = blockSize;
+	bus->numEntries = 0;
+	bus->addr = allocate(depth + 1, sizeof(int));
+	bus->data = allocate((long long)(depth + 1) * blockSize, sizeof(int));
+	bus->valid = allocate((long long)(depth + 1) * blockSize, sizeof(unsigned char));
+	bus->wordsRead = 0;
+	bus->wordsWritten = 0;
+	bus->coalesced = 0;
+	bus->fullStalls = 0;
+}
+
+/* read size words from memory, taking any still waiting in the write buffer */
+void readMemory(int block, int size, int *dest, stateType *state) {
+	busType *bus = state->bus;
+	int i, j;
+	size = wordsInMemory(block, size);
+	for (i=0; i < size; i++)
+		dest[i] = state->mem[block + i];
+	bus->cycles += bus->latency;
+	for (i=0; i < bus->numEntries; i++) {
+		for (j=0; j < bus->blockSize; j++) {
+			int addr = bus->addr[i] + j;
+			if (bus->valid[i * bus->blockSize + j] && addr >= block && addr < block + size)
+				dest[addr - block] = bus->data[i * bus->blockSize + j];
+		}
+	}
+	bus->wordsRead += size;
+}
+
+/*
+ * Write size words to memory from the level named sourceName, through the
+ * write buffer if there is one.
  */
-int load(cacheType *cache, int addr, stateType *state) {
+void writeMemory(int block, int size, int *source, char *sourceName, stateType *state) {
+	busType *bus = state->bus;
+	int i;
+	size = wordsInMemory(block, size);
+	if (bus->depth == 0) {
+		printAction(state, block, size, sourceName, "memory");
+		for (i=0; i < size; i++)
+			state->mem[block + i] = source[i];
+		bus->wordsWritten += size;
+		return;
+	}
+
+	printAction(state, block, size, sourceName, "write buffer");
+	int entry;
+	for (entry=0; entry < bus->numEntries; entry++)
+		if (bus->addr[entry] + bus->blockSize > block && bus->addr[entry] < block + size)
+			break;
+	if (entry < bus->numEntries)
+		bus->coalesced++;
+
+	for (i=0; i < size; i++) {
+		int addr = block + i;
+		for (entry=0; entry < bus->numEntries && bus->addr[entry] != addr - addr % bus->blockSize; entry++)
+			;
+		if (entry == bus->numEntries) {
+			if (bus->numEntries == bus->depth) {
+				bus->fullStalls++;
+				drainEntry(state);
+				entry--;
+			}
+			bus->addr[entry] = addr - addr % bus->blockSize;
+			memset(&bus->valid[entry * bus->blockSize], 0, bus->blockSize);
+			bus->numEntries++;
+		}
+		bus->data[entry * bus->blockSize + addr % bus->blockSize] = source[i];
+		bus->valid[entry * bus->blockSize + addr % bus->blockSize] = 1;
+	}
+}
+
+/* write the oldest write buffer entry to memory */
+void drainEntry(stateType *state) {
+	busType *bus = state->bus;
+	int i;
+	printAction(state, bus->addr[0], bus->blockSize, "write buffer", "memory");
+	for (i=0; i < bus->blockSize; i++) {
+		if (bus->valid[i]) {
+			state->mem[bus->addr[0] + i] = bus->data[i];
+			bus->wordsWritten++;
+		}
+	}
+	bus->numEntries--;
+	memmove(bus->addr, &bus->addr[1], bus->numEntries * sizeof(int));
+	memmove(bus->data, &bus->data[bus->blockSize], (long)bus->numEntries * bus->blockSize * sizeof(int));
+	memmove(bus->valid, &bus->valid[bus->blockSize], (long)bus->numEntries * bus->blockSize);
+}
+
+/* blockSize,numberOfSets,blocksPerSet[,latency] from an option argument */
+void parseGeometry(char *spec, int *fields, int count) {
+	if (sscanf(spec, "%d,%d,%d,%d", &fields[0], &fields[1], &fields[2], &fields[3]) != count) {
+		tracePrintf("error: bad cache geometry %s\n", spec);
+		traceExit(1);
+	}
+}
+
+/* zeroed array of count elements, or an error if it can't be had */
+void *allocate(long long count, size_t size) {
+	void *array = NULL;
+	if ((unsigned long long)count <= ((size_t)-1) / size)
+		array = calloc(count, size);
+	if (array == NULL) {
+		tracePrintf("error: out of memory for the cache\n");
+		traceExit(1);
+	}
+	return array;
+}
+
+/*
+ * How many of the size words starting at block are in memory.  A block
+ * size that doesn't divide NUMMEMORY leaves the last block of the address
+ * space hanging off the end; only the part in memory is ever moved.
+ */
+int wordsInMemory(int block, int size) {
+	return block + size > NUMMEMORY ? NUMMEMORY - block : size;
+}
+
+/* index in the per-way arrays of the way holding addr, or -1 */
+int lookupBlock(cacheType *cache, int addr) {
 	int set = (addr % (cache->blockSize * cache->numSets)) / cache->blockSize;
 	int tag = addr / (cache->blockSize * cache->numSets);
+	int *tags = &cache->tag[set * cache->blocksPerSet];
+	int i;
+	for (i=0; i < cache->blocksPerSet; i++)
+		if (tags[i]==tag)
+			return set * cache->blocksPerSet + i;
+	return -1;
+}
+
+/*
+ * Find the way of addr's set that holds addr's block, bringing the block
+ * in from the level below on a miss.  Returns the way's index in the
+ * per-way arrays.
+ */
+int findBlock(cacheType *cache, int addr, stateType *state) {
+	cache->accesses++;
+	int index = lookupBlock(cache, addr);
+	if (index >= 0) {
+		/* Hit */
+		cache->policy->touch(cache, index / cache->blocksPerSet, index % cache->blocksPerSet);
+		return index;
+	}
+	cache->misses++;
+	return fillBlock(cache, addr, 1, state);
+}
+
+/*
+ * Make room for addr's block in its set and claim a way for it, filling
+ * the way from the level below if fetch is set.  Misses take the lowest
+ * invalid way first and evict only when the set is full.
+ */
+int fillBlock(cacheType *cache, int addr, int fetch, stateType *state) {
+	int set = (addr % (cache->blockSize * cache->numSets)) / cache->blockSize;
 	int block = ((int)(addr/cache->blockSize))*cache->blockSize;
-	int offset = addr % cache->blockSize;
+	int *tags = &cache->tag[set * cache->blocksPerSet];
+
+	int way;
+	for (way=0; way < cache->blocksPerSet && tags[way] >= 0; way++)
+		;
+	if (way == cache->blocksPerSet) {
+		/* Conflict miss */
+		way = cache->policy->victim(cache, set);
+		evict(cache, set * cache->blocksPerSet + way, state);
+	}
 
+	int index = set * cache->blocksPerSet + way;
+	cache->dirty[index] = 0;
+	cache->prefetched[index] = 0;
+	if (fetch) {
+		if (cache->sibling != NULL)
+			cleanSibling(cache, block, state);
+		cache->dirty[index] = fetchBlock(cache->next, block, cache->blockSize,
+			&cache->data[(long)index * cache->blockSize], cache->name, state);
+	}
+	tags[way] = addr / (cache->blockSize * cache->numSets);
+	cache->policy->insert(cache, set, way);
+	return index;
+}
+
+/*
+ * Throw out the block in a way, first pulling back any copies above an
+ * inclusive level, and pass it down: dirty blocks are written back, clean
+ * ones dropped unless the level below is exclusive.
+ */
+void evict(cacheType *cache, int index, stateType *state) {
+	int set = index / cache->blocksPerSet;
+	int victimBlock = cache->blockSize*set+cache->tag[index]*cache->blockSize*cache->numSets;
+	int *victimData = &cache->data[(long)index * cache->blockSize];
+	int dirty = cache->dirty[index];
 	int i;
-	for (i=0; i < cache->blocksPerSet; i++) {
 
-		/* Hit */
-		if (cache->sets[set].valid[i]==1 && cache->sets[set].tag[i]==tag) {
-			adjustLRU(cache, set, i);
-			printAction(addr, 1, cacheToProcessor);
-			return cache->sets[set].data[i*cache->blockSize + offset];
-
-		/* Compulsory miss */
-		} else if (cache->sets[set].valid[i]==0) {
-			cache->sets[set].valid[i] = 1;
-			cache->sets[set].tag[i] = tag;
-			int j;
-			for (j=0; j < cache->blockSize; j++)
-				cache->sets[set].data[i*cache->blockSize + j] = state->mem[block + j];
-			adjustLRU(cache, set, i);
-			printAction(block, cache->blockSize, memoryToCache);
-			printAction(addr, 1, cacheToProcessor);
-			return cache->sets[set].data[i*cache->blockSize + offset];
+	if (cache->inclusion == inclusive)
+		for (i=0; i < cache->numUpper; i++)
+			dirty |= invalidateRange(cache->upper[i], victimBlock, cache->blockSize, victimData, cache->name, state);
+
+	cache->tag[index] = -1;
+	cache->dirty[index] = 0;
+	if (dirty)
+		cache->writebacks++;
+	writeBlock(cache->next, victimBlock, cache->blockSize, victimData, dirty, cache->name, state);
+}
+
+/*
+ * Copy size words starting at block from level (memory if NULL) into
+ * dest for the level named destName.  Returns whether the copy is dirty,
+ * which only happens when an exclusive level hands a dirty block up.
+ */
+int fetchBlock(cacheType *level, int block, int size, int *dest, char *destName, stateType *state) {
+	int index;
+	if (level == NULL) {
+		readMemory(block, size, dest, state);
+		printAction(state, block, size, "memory", destName);
+		return 0;
+	}
+
+	state->bus->cycles += level->latency;
+	if (level->inclusion == exclusive) {
+		level->accesses++;
+		index = lookupBlock(level, block);
+		if (index < 0) {
+			level->misses++;
+			return fetchBlock(level->next, block, size, dest, destName, state);
 		}
+		int dirty = level->dirty[index];
+		memcpy(dest, &level->data[(long)index * level->blockSize], size * sizeof(int));
+		level->tag[index] = -1;
+		level->dirty[index] = 0;
+		printAction(state, block, size, level->name, destName);
+		return dirty;
 	}
 
-	/* Determine LRU */
-	int max = cache->sets[set].LRUbits[0];
-	cache->sets[set].LRU = 0;
-	for (i=0; i < cache->blocksPerSet; i++) {
-		if (max < cache->sets[set].LRUbits[i]) {
-			max = cache->sets[set].LRUbits[i];
-			cache->sets[set].LRU = i;
+	index = findBlock(level, block, state);
+	memcpy(dest, &level->data[(long)index * level->blockSize + block % level->blockSize], size * sizeof(int));
+	printAction(state, block, size, level->name, destName);
+	return 0;
+}
+
+/*
+ * Hand a block evicted from the level named sourceName down to level
+ * (memory if NULL).
+ */
+void writeBlock(cacheType *level, int block, int size, int *source, int dirty, char *sourceName, stateType *state) {
+	int index;
+	if (level == NULL) {
+		if (dirty)
+			writeMemory(block, size, source, sourceName, state);
+		else
+			printAction(state, block, size, sourceName, NULL);
+		return;
+	}
+
+	if (!dirty && level->inclusion != exclusive) {
+		printAction(state, block, size, sourceName, NULL);
+		return;
+	}
+
+	/* a write-back fills a missing block only if it doesn't cover it */
+	index = lookupBlock(level, block);
+	if (index < 0)
+		index = fillBlock(level, block, level->blockSize > size, state);
+	memcpy(&level->data[(long)index * level->blockSize + block % level->blockSize], source, size * sizeof(int));
+	level->dirty[index] |= dirty;
+	printAction(state, block, size, sourceName, level->name);
+}
+
+/*
+ * Drop every copy of size words starting at block from level and the
+ * levels above it, merging dirty words into dest for the level named
+ * destName.  Returns whether any were dirty.
+ */
+int invalidateRange(cacheType *level, int block, int size, int *dest, char *destName, stateType *state) {
+	int anyDirty = 0;
+	int addr, i;
+	for (addr = block; addr < block + size; addr += level->blockSize) {
+		int index = lookupBlock(level, addr);
+		if (index < 0)
+			continue;
+		int *data = &level->data[(long)index * level->blockSize];
+		int dirty = level->dirty[index];
+		for (i=0; i < level->numUpper; i++)
+			dirty |= invalidateRange(level->upper[i], addr, level->blockSize, data, level->name, state);
+		if (dirty) {
+			memcpy(&dest[addr - block], data, level->blockSize * sizeof(int));
+			printAction(state, addr, level->blockSize, level->name, destName);
+			anyDirty = 1;
+		} else
+			printAction(state, addr, level->blockSize, level->name, NULL);
+		level->tag[index] = -1;
+		level->dirty[index] = 0;
+	}
+	return anyDirty;
+}
+
+/*
+ * Before half of a split L1 fetches a block, write back any dirty copy
+ * the other half holds so the fetch sees the latest data.
+ */
+void cleanSibling(cacheType *cache, int block, stateType *state) {
+	cacheType *sibling = cache->sibling;
+	int addr;
+	for (addr = block - block % sibling->blockSize; addr < block + cache->blockSize; addr += sibling->blockSize) {
+		int index = lookupBlock(sibling, addr);
+		if (index < 0 || !sibling->dirty[index])
+			continue;
+		sibling->dirty[index] = 0;
+		sibling->writebacks++;
+		writeBlock(sibling->next, addr, sibling->blockSize,
+			&sibling->data[(long)index * sibling->blockSize], 1, sibling->name, state);
+	}
+}
+
+/*
+ * A one-word write from the processor, or passed through from the level
+ * named sourceName, arriving at level (memory if NULL).  Write-back levels
+ * keep the word and mark its block dirty; write-through levels keep it
+ * only if they hold the block and pass it on.  A write miss brings the
+ * block in only under write-allocate, and never into an exclusive level.
+ */
+void writeWord(cacheType *level, int addr, int data, char *sourceName, stateType *state) {
+	if (level == NULL) {
+		writeMemory(addr, 1, &data, sourceName, state);
+		return;
+	}
+
+	level->accesses++;
+	int index = lookupBlock(level, addr);
+	if (index >= 0)
+		level->policy->touch(level, index / level->blocksPerSet, index % level->blocksPerSet);
+	else {
+		level->misses++;
+		if (!level->writeAllocate || level->inclusion == exclusive) {
+			writeWord(level->next, addr, data, sourceName, state);
+			return;
 		}
+		index = fillBlock(level, addr, 1, state);
 	}
 
-	/* Write back */
-	if (cache->sets[set].dirty[cache->sets[set].LRU]==1) {
-		printAction(cache->blockSize*set+cache->sets[set].tag[cache->sets[set].LRU]*cache->blockSize*cache->numSets, cache->blockSize, cacheToMemory);
-		for (i=0; i < cache->blockSize; i++)
-			state->mem[cache->blockSize*set+cache->sets[set].tag[cache->sets[set].LRU]*cache->blockSize*cache->numSets + i] = cache->sets[set].data[cache->sets[set].LRU*cache->blockSize+i];
-		cache->sets[set].dirty[cache->sets[set].LRU] = 0;
-	} else
-		printAction(cache->blockSize*set+cache->sets[set].tag[cache->sets[set].LRU]*cache->blockSize*cache->numSets, cache->blockSize, cacheToNowhere);
+	level->data[(long)index*level->blockSize + addr % level->blockSize] = data;
+	printAction(state, addr, 1, sourceName, level->name);
+	if (level->writeThrough)
+		writeWord(level->next, addr, data, level->name, state);
+	else
+		level->dirty[index] = 1;
+}
 
-	/* Conflict miss */
-	cache->sets[set].valid[cache->sets[set].LRU] = 1;
-	cache->sets[set].tag[cache->sets[set].LRU] = tag;
-	for (i=0; i < cache->blockSize; i++)
-		cache->sets[set].data[cache->sets[set].LRU*cache->blockSize + i] = state->mem[block + i];
-	adjustLRU(cache, set, cache->sets[set].LRU);
-	printAction(block, cache->blockSize, memoryToCache);
-	printAction(addr, 1, cacheToProcessor);
-	return cache->sets[set].data[cache->sets[set].LRU*cache->blockSize + offset];
+/* load() for an instruction fetch */
+int fetch(cacheType *cache, int addr, stateType *state) {
+	if (state->recording != NULL)
+		recordReference(state, fetchReference, addr);
+	if (state->sweep != NULL) {
+		collectReference(state->sweep, fetchReference, addr);
+		return state->mem[addr];
+	}
+	if (state->profile != NULL) {
+		profileReference(state->profile, addr);
+		return state->mem[addr];
+	}
+	int hit = notePrefetches(cache, instructionAccess, addr, state);
+	int way = findBlock(cache, addr, state);
+	printAction(state, addr, 1, cache->name, "processor");
+	int instruction = cache->data[(long)way*cache->blockSize + addr % cache->blockSize];
+	trainPrefetcher(cache, instructionAccess, addr, addr, hit, state);
+	return instruction;
+}
+
+/**
+ * Properly simulates the cache for a load from
+ * memory address “addr”. Returns the loaded value.
+ * Called after run() has advanced the pc past the lw.
+ */
+int load(cacheType *cache, int addr, stateType *state) {
+	if (state->recording != NULL)
+		recordReference(state, loadReference, addr);
+	if (state->sweep != NULL) {
+		collectReference(state->sweep, loadReference, addr);
+		return state->mem[addr];
+	}
+	if (state->profile != NULL) {
+		profileReference(state->profile, addr);
+		return state->mem[addr];
+	}
+	int hit = notePrefetches(cache, dataAccess, addr, state);
+	int way = findBlock(cache, addr, state);
+	printAction(state, addr, 1, cache->name, "processor");
+	int data = cache->data[(long)way*cache->blockSize + addr % cache->blockSize];
+	trainPrefetcher(cache, dataAccess, state->pc - 1, addr, hit, state);
+	return data;
 }
 
 /**
  * Properly simulates the cache for a store 
  * to memory address “addr”. Returns nothing.
+ * Under a split L1 the instruction half's copy, if any, goes stale and is
+ * dropped.
  */
 void store(cacheType *cache, int addr, int data, stateType *state) {
+	if (state->recording != NULL)
+		recordReference(state, storeReference, addr);
+	if (state->sweep != NULL) {
+		collectReference(state->sweep, storeReference, addr);
+		state->mem[addr] = data;
+		return;
+	}
+	if (state->profile != NULL) {
+		profileReference(state->profile, addr);
+		state->mem[addr] = data;
+		return;
+	}
+	int hit = notePrefetches(cache, dataAccess, addr, state);
+	writeWord(cache, addr, data, "processor", state);
+	if (cache->sibling != NULL) {
+		int index = lookupBlock(cache->sibling, addr);
+		if (index >= 0) {
+			printAction(state, addr - addr % cache->sibling->blockSize, cache->sibling->blockSize, cache->sibling->name, NULL);
+			cache->sibling->tag[index] = -1;
+		}
+	}
+	trainPrefetcher(cache, dataAccess, state->pc - 1, addr, hit, state);
+}
+
+/* append one reference to the address trace being recorded */
+void recordReference(stateType *state, int kind, int addr) {
+	int delta = addr - state->lastRecorded[kind];
+	unsigned int rest = ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+	state->lastRecorded[kind] = addr;
+
+	putc(kind << 6 | (rest > 0x1f ? 0x20 : 0) | (rest & 0x1f), state->recording);
+	for (rest >>= 5; rest != 0; rest >>= 7)
+		putc((rest > 0x7f ? 0x80 : 0) | (rest & 0x7f), state->recording);
+}
+
+/* a prefetcher from name[,degree] for the given kind of access */
+prefetcherType *newPrefetcher(char *spec, int kind) {
+	prefetcherType *prefetcher = allocate(1, sizeof(prefetcherType));
+	char *comma = strchr(spec, ',');
+	int length = strcspn(spec, ",");
+	int i;
+	for (i=0; i<NUMPREFETCHERS && (strncmp(prefetchers[i].name, spec, length) || prefetchers[i].name[length]); i++)
+		;
+	if (i == NUMPREFETCHERS) {
+		tracePrintf("error: unknown prefetcher %s\n", spec);
+		traceExit(1);
+	}
+	prefetcher->policy = &prefetchers[i];
+	prefetcher->kind = kind;
+	prefetcher->degree = comma ? atoi(comma + 1) : 1;
+	if (prefetcher->degree < 1) {
+		tracePrintf("error: prefetch degree must be positive\n");
+		traceExit(1);
+	}
+	for (i=0; i<RPTSIZE; i++)
+		prefetcher->rptPc[i] = -1;
+	for (i=0; i<FILTERSIZE; i++)
+		prefetcher->evicted[i] = -1;
+	return prefetcher;
+}
+
+void printPrefetcher(prefetcherType *prefetcher) {
+	long long useful = prefetcher->useful;
+	tracePrintf("%s prefetcher for %s: %lld issued, %lld useful, %lld late, accuracy %.2f%%, coverage %.2f%%, timeliness %.2f%%, %lld pollution misses\n",
+		prefetcher->policy->name, accessNames[prefetcher->kind], prefetcher->issued, useful, prefetcher->late,
+		prefetcher->issued > 0 ? 100.0 * useful / prefetcher->issued : 0.0,
+		useful + prefetcher->demandMisses > 0 ? 100.0 * useful / (useful + prefetcher->demandMisses) : 0.0,
+		useful > 0 ? 100.0 * (useful - prefetcher->late) / useful : 0.0,
+		prefetcher->pollution);
+}
+
+/*
+ * Before a demand access: count its time, credit the prefetcher whose
+ * block it hits, waiting for the block if it is still on its way, or on
+ * a miss charge any prefetcher that threw the block out.  Returns whether
+ * the access hits.
+ */
+int notePrefetches(cacheType *cache, int kind, int addr, stateType *state) {
+	busType *bus = state->bus;
+	bus->cycles += cache->latency;
+	if (cache->prefetcher[instructionAccess] == NULL && cache->prefetcher[dataAccess] == NULL)
+		return 0;
+
+	int index = lookupBlock(cache, addr);
+	if (index >= 0) {
+		if (cache->prefetched[index]) {
+			prefetcherType *owner = cache->prefetcher[cache->prefetched[index] - 1];
+			owner->useful++;
+			if (bus->cycles < cache->readyAt[index]) {
+				owner->late++;
+				bus->cycles = cache->readyAt[index];
+			}
+			cache->prefetched[index] = 0;
+		}
+		return 1;
+	}
+
+	int block = addr / cache->blockSize;
+	int i;
+	if (cache->prefetcher[kind] != NULL)
+		cache->prefetcher[kind]->demandMisses++;
+	for (i=0; i<2; i++) {
+		prefetcherType *prefetcher = cache->prefetcher[i];
+		if (prefetcher != NULL && prefetcher->evicted[block % FILTERSIZE] == block) {
+			prefetcher->pollution++;
+			prefetcher->evicted[block % FILTERSIZE] = -1;
+		}
+	}
+	return 0;
+}
+
+/* after a demand access, let its kind's prefetcher see it */
+void trainPrefetcher(cacheType *cache, int kind, int pc, int addr, int hit, stateType *state) {
+	prefetcherType *prefetcher = cache->prefetcher[kind];
+	if (prefetcher == NULL)
+		return;
+	if (!hit)
+		prefetcher->policy->miss(cache, prefetcher, pc, addr, state);
+	prefetcher->policy->access(cache, prefetcher, pc, addr, state);
+}
+
+/*
+ * Bring addr's block in ahead of demand unless it is already here.  The
+ * fill overlaps with execution: it is timed only to know when the block
+ * arrives.
+ */
+void prefetchBlock(cacheType *cache, prefetcherType *prefetcher, int addr, stateType *state) {
+	int block = addr - addr % cache->blockSize;
+	if (addr < 0 || block + cache->blockSize > NUMMEMORY || lookupBlock(cache, addr) >= 0)
+		return;
+
 	int set = (addr % (cache->blockSize * cache->numSets)) / cache->blockSize;
-	int tag = addr / (cache->blockSize * cache->numSets);
-	int block = ((int)(addr/cache->blockSize))*cache->blockSize;
-	int offset = addr % cache->blockSize;
+	int *tags = &cache->tag[set * cache->blocksPerSet];
+	int way;
+	for (way=0; way < cache->blocksPerSet && tags[way] >= 0; way++)
+		;
+	if (way == cache->blocksPerSet) {
+		way = cache->policy->victim(cache, set);
+		int victim = set + tags[way] * cache->numSets;
+		prefetcher->evicted[victim % FILTERSIZE] = victim;
+		evict(cache, set * cache->blocksPerSet + way, state);
+	}
 
+	long long now = state->bus->cycles;
+	int index = fillBlock(cache, addr, 1, state);
+	cache->prefetched[index] = prefetcher->kind + 1;
+	cache->readyAt[index] = state->bus->cycles;
+	state->bus->cycles = now;
+	prefetcher->issued++;
+}
+
+void prefetchNothing(cacheType *cache, prefetcherType *prefetcher, int pc, int addr, stateType *state) {
+}
+
+/* fetch the next degree blocks after each miss */
+void missNextLine(cacheType *cache, prefetcherType *prefetcher, int pc, int addr, stateType *state) {
 	int i;
-	for (i=0; i < cache->blocksPerSet; i++) {
+	for (i=1; i <= prefetcher->degree; i++)
+		prefetchBlock(cache, prefetcher, addr - addr % cache->blockSize + i * cache->blockSize, state);
+}
 
-		/* Hit */
-		if (cache->sets[set].valid[i]==1 && cache->sets[set].tag[i]==tag) {
-			cache->sets[set].dirty[i] = 1;
-			cache->sets[set].data[i*cache->blockSize + offset] = data;
-			adjustLRU(cache, set, i);
-			printAction(addr, 1, processorToCache);
-			return;
+/*
+ * Reference prediction table (Chen and Baer): each pc's last address and
+ * stride, trusted once the same stride has been seen twice in a row.
+ */
+void accessStride(cacheType *cache, prefetcherType *prefetcher, int pc, int addr, stateType *state) {
+	int entry = pc % RPTSIZE;
+	if (prefetcher->rptPc[entry] != pc) {
+		prefetcher->rptPc[entry] = pc;
+		prefetcher->rptLast[entry] = addr;
+		prefetcher->rptStride[entry] = 0;
+		prefetcher->rptState[entry] = initial;
+		return;
+	}
+
+	int stride = addr - prefetcher->rptLast[entry];
+	int correct = stride == prefetcher->rptStride[entry];
+	int *rptState = &prefetcher->rptState[entry];
+	if (*rptState == initial)
+		*rptState = correct ? steady : transient;
+	else if (*rptState == transient)
+		*rptState = correct ? steady : noPrediction;
+	else if (*rptState == steady)
+		*rptState = correct ? steady : initial;
+	else
+		*rptState = correct ? transient : noPrediction;
+	if (!correct && *rptState != initial)
+		prefetcher->rptStride[entry] = stride;
+	prefetcher->rptLast[entry] = addr;
 
-		/* Compulsory miss */
-		} else if (cache->sets[set].valid[i]==0) {
-			cache->sets[set].valid[i] = 1;
-			cache->sets[set].dirty[i] = 1;
-			cache->sets[set].tag[i] = tag;
-			int j;
-			for (j=0; j < cache->blockSize; j++)
-				cache->sets[set].data[i*cache->blockSize + j] = state->mem[block + j];
-			cache->sets[set].data[i*cache->blockSize + offset] = data;
-			adjustLRU(cache, set, i);
-			printAction(block, cache->blockSize, memoryToCache);
-			printAction(addr, 1, processorToCache);
+	int i;
+	if (*rptState == steady && stride != 0)
+		for (i=1; i <= prefetcher->degree; i++)
+			prefetchBlock(cache, prefetcher, addr + i * stride, state);
+}
+
+/*
+ * Stream prefetcher: two misses to adjacent blocks start a stream in
+ * their direction, which then stays degree blocks ahead of the accesses
+ * that follow it.
+ */
+void missStream(cacheType *cache, prefetcherType *prefetcher, int pc, int addr, stateType *state) {
+	int block = addr - addr % cache->blockSize;
+	int i, oldest = 0;
+	for (i=0; i<NUMSTREAMS; i++) {
+		int dir = prefetcher->streamDir[i];
+		int last = prefetcher->streamLast[i];
+		if (prefetcher->streamUsed[i] == 0)
+			continue;
+		if (dir == 0 && (block == last + cache->blockSize || block == last - cache->blockSize)) {
+			/* confirmed */
+			prefetcher->streamDir[i] = block > last ? 1 : -1;
+			prefetcher->streamAhead[i] = block;
+			advanceStream(cache, prefetcher, i, block, state);
 			return;
 		}
+		if (dir != 0 && (block - last) * dir > 0 && (block - prefetcher->streamAhead[i]) * dir <= cache->blockSize) {
+			/* ran ahead of its prefetches */
+			if ((block - prefetcher->streamAhead[i]) * dir > 0)
+				prefetcher->streamAhead[i] = block;
+			advanceStream(cache, prefetcher, i, block, state);
+			return;
+		}
+		if (prefetcher->streamUsed[i] < prefetcher->streamUsed[oldest])
+			oldest = i;
+	}
+	for (i=0; i<NUMSTREAMS; i++)
+		if (prefetcher->streamUsed[i] == 0)
+			oldest = i;
+
+	prefetcher->streamLast[oldest] = block;
+	prefetcher->streamDir[oldest] = 0;
+	prefetcher->streamUsed[oldest] = ++prefetcher->stamp;
+}
+
+void accessStream(cacheType *cache, prefetcherType *prefetcher, int pc, int addr, stateType *state) {
+	int block = addr - addr % cache->blockSize;
+	int i;
+	for (i=0; i<NUMSTREAMS; i++)
+		if (prefetcher->streamDir[i] != 0 && block == prefetcher->streamLast[i] + prefetcher->streamDir[i] * cache->blockSize)
+			advanceStream(cache, prefetcher, i, block, state);
+}
+
+/* move stream i on to block and top its prefetches back up */
+void advanceStream(cacheType *cache, prefetcherType *prefetcher, int i, int block, stateType *state) {
+	int step = prefetcher->streamDir[i] * cache->blockSize;
+	prefetcher->streamLast[i] = block;
+	prefetcher->streamUsed[i] = ++prefetcher->stamp;
+	while ((prefetcher->streamAhead[i] - block) / step < prefetcher->degree) {
+		prefetcher->streamAhead[i] += step;
+		prefetchBlock(cache, prefetcher, prefetcher->streamAhead[i], state);
 	}
+}
 
-	/* Determine LRU */
-	int max = cache->sets[set].LRUbits[0];
-	cache->sets[set].LRU = 0;
+/*
+ * True LRU in O(1): a hit or fill moves the way to the most recently used
+ * end of its set's list, and the victim is whatever is at the other end.
+ */
+void resetLRU(cacheType *cache, int set) {
+	int *older = &cache->older[set * cache->blocksPerSet];
+	int *newer = &cache->newer[set * cache->blocksPerSet];
+	int i;
 	for (i=0; i < cache->blocksPerSet; i++) {
-		if (max<cache->sets[set].LRUbits[i]) {
-			max = cache->sets[set].LRUbits[i];
-			cache->sets[set].LRU = i;
+		older[i] = i + 1 < cache->blocksPerSet ? i + 1 : -1;
+		newer[i] = i - 1;
+	}
+	cache->mru[set] = 0;
+	cache->lru[set] = cache->blocksPerSet - 1;
+}
+
+void touchLRU(cacheType *cache, int set, int way) {
+	int *older = &cache->older[set * cache->blocksPerSet];
+	int *newer = &cache->newer[set * cache->blocksPerSet];
+	if (cache->mru[set] == way)
+		return;
+	/* unlink */
+	older[newer[way]] = older[way];
+	if (older[way] >= 0)
+		newer[older[way]] = newer[way];
+	else
+		cache->lru[set] = newer[way];
+	/* relink at the front */
+	newer[way] = -1;
+	older[way] = cache->mru[set];
+	newer[cache->mru[set]] = way;
+	cache->mru[set] = way;
+}
+
+int victimLRU(cacheType *cache, int set) {
+	return cache->lru[set];
+}
+
+/*
+ * Tree-PLRU over a power-of-two number of ways: node n (from 1) has
+ * children 2n and 2n+1, the ways are the leaves, and each node's bit
+ * points to the half that was used less recently.
+ */
+void resetPLRU(cacheType *cache, int set) {
+	memset(&cache->bits[set * cache->blocksPerSet], 0, cache->blocksPerSet * sizeof(int));
+}
+
+void touchPLRU(cacheType *cache, int set, int way) {
+	int node = way + cache->blocksPerSet;
+	while (node > 1) {
+		cache->bits[set * cache->blocksPerSet + node / 2] = !(node & 1);
+		node /= 2;
+	}
+}
+
+int victimPLRU(cacheType *cache, int set) {
+	int node = 1;
+	while (node < cache->blocksPerSet)
+		node = 2 * node + cache->bits[set * cache->blocksPerSet + node];
+	return node - cache->blocksPerSet;
+}
+
+/* FIFO: ways fill in order, so replacing them round-robin evicts the oldest */
+void resetFIFO(cacheType *cache, int set) {
+	cache->nextFill[set] = 0;
+}
+
+int victimFIFO(cacheType *cache, int set) {
+	int way = cache->nextFill[set];
+	cache->nextFill[set] = (way + 1) % cache->blocksPerSet;
+	return way;
+}
+
+void resetNothing(cacheType *cache, int set) {
+}
+
+void touchNothing(cacheType *cache, int set, int way) {
+}
+
+/* small deterministic LCG so every run evicts the same blocks */
+int victimRandom(cacheType *cache, int set) {
+	cache->seed = cache->seed * 1103515245u + 12345u;
+	return ((cache->seed >> 16) & 0x7fff) % cache->blocksPerSet;
+}
+
+/*
+ * Static RRIP with 2-bit re-reference predictions: blocks come in
+ * predicted to be re-referenced in the distant future (2), a hit predicts
+ * near-immediate reuse (0), and the victim is the first way predicted
+ * furthest out (3), aging the whole set until there is one.
+ */
+#define RRIPMAX 3
+
+void resetRRIP(cacheType *cache, int set) {
+	int i;
+	for (i=0; i < cache->blocksPerSet; i++)
+		cache->bits[set * cache->blocksPerSet + i] = RRIPMAX;
+}
+
+void insertRRIP(cacheType *cache, int set, int way) {
+	cache->bits[set * cache->blocksPerSet + way] = RRIPMAX - 1;
+}
+
+void touchRRIP(cacheType *cache, int set, int way) {
+	cache->bits[set * cache->blocksPerSet + way] = 0;
+}
+
+int victimRRIP(cacheType *cache, int set) {
+	int *rrpv = &cache->bits[set * cache->blocksPerSet];
+	int i;
+	while (1) {
+		for (i=0; i < cache->blocksPerSet; i++)
+			if (rrpv[i] == RRIPMAX)
+				return i;
+		for (i=0; i < cache->blocksPerSet; i++)
+			rrpv[i]++;
+	}
+}
+
+/* profile for block sizes, set counts and associativities up to the given ones */
+void initProfile(profileType *profile, int blockSize, int numSets, int blocksPerSet) {
+	int i, j, total = 0;
+	if (blockSize < 1 || numSets < 1 || blocksPerSet < 1) {
+		tracePrintf("error: blockSizeInWords, numberOfSets and blocksPerSet must be positive\n");
+		traceExit(1);
+	}
+	if (blockSize > NUMMEMORY) {
+		tracePrintf("error: blockSizeInWords must be at most %d\n", NUMMEMORY);
+		traceExit(1);
+	}
+	if ((blockSize & (blockSize - 1)) != 0 || (numSets & (numSets - 1)) != 0) {
+		tracePrintf("error: -A needs a power of two blockSizeInWords and numberOfSets\n");
+		traceExit(1);
+	}
+	for (profile->numSizes=0; (1 << profile->numSizes) <= blockSize; profile->numSizes++)
+		;
+	for (profile->numSetCounts=0; (1 << profile->numSetCounts) <= numSets; profile->numSetCounts++)
+		;
+	profile->maxWays = blocksPerSet;
+	profile->offset = allocate(profile->numSizes * profile->numSetCounts, sizeof(int));
+	for (i=0; i < profile->numSizes; i++) {
+		for (j=0; j < profile->numSetCounts; j++) {
+			profile->offset[i * profile->numSetCounts + j] = total;
+			total += (1 << j) * blocksPerSet;
+		}
+	}
+	profile->stacks = allocate(total, sizeof(int));
+	for (i=0; i < total; i++)
+		profile->stacks[i] = -1;
+	profile->hits = allocate((long long)profile->numSizes * profile->numSetCounts * blocksPerSet, sizeof(long long));
+	profile->references = 0;
+}
+
+/* push one referenced word address through every stack */
+void profileReference(profileType *profile, int addr) {
+	int i, j, depth;
+	profile->references++;
+	for (i=0; i < profile->numSizes; i++) {
+		int block = addr >> i;
+		for (j=0; j < profile->numSetCounts; j++) {
+			int *stack = &profile->stacks[profile->offset[i * profile->numSetCounts + j] +
+				(block & ((1 << j) - 1)) * profile->maxWays];
+			for (depth=0; depth < profile->maxWays && stack[depth] != block && stack[depth] >= 0; depth++)
+				;
+			if (depth < profile->maxWays && stack[depth] == block)
+				profile->hits[(i * profile->numSetCounts + j) * profile->maxWays + depth]++;
+			else if (depth == profile->maxWays)
+				depth--;
+			memmove(&stack[1], stack, depth * sizeof(int));
+			stack[0] = block;
 		}
 	}
+}
+
+/* the associativity printed after ways: the next power of two, but never past maxWays */
+int nextWays(int ways, int maxWays) {
+	return ways < maxWays && ways * 2 > maxWays ? maxWays : ways * 2;
+}
 
-	/* Write back */
-	if (cache->sets[set].dirty[cache->sets[set].LRU]==1) {
-		printAction(cache->blockSize*set+cache->sets[set].tag[cache->sets[set].LRU]*cache->blockSize*cache->numSets, cache->blockSize, cacheToMemory);
-		for (i=0; i < cache->blockSize; i++)
-			state->mem[cache->blockSize*set+cache->sets[set].tag[cache->sets[set].LRU]*cache->blockSize*cache->numSets + i] = cache->sets[set].data[cache->sets[set].LRU*cache->blockSize+i];
-		cache->sets[set].dirty[cache->sets[set].LRU] = 0;
-	} else
-		printAction(cache->blockSize*set+cache->sets[set].tag[cache->sets[set].LRU]*cache->blockSize*cache->numSets, cache->blockSize, cacheToNowhere);
-
-	/* Conflict miss */
-	cache->sets[set].valid[cache->sets[set].LRU] = 1;
-	cache->sets[set].tag[cache->sets[set].LRU] = tag;
-	cache->sets[set].dirty[cache->sets[set].LRU] = 1;
-	for (i=0; i < cache->blockSize; i++)
-		cache->sets[set].data[cache->sets[set].LRU*cache->blockSize + i] = state->mem[block + i];
-	cache->sets[set].data[cache->sets[set].LRU*cache->blockSize + offset] = data;
-	adjustLRU(cache, set, cache->sets[set].LRU);
-	printAction(block, cache->blockSize, memoryToCache);
-	printAction(addr, 1, processorToCache);
-	return;
+/* miss rates of LRU caches for every block size and set count, by associativity */
+void printProfile(profileType *profile) {
+	int i, j, ways, depth;
+	tracePrintf("stack distance profile of %lld references, LRU miss rates (%%)\n", profile->references);
+	tracePrintf("blockSize numberOfSets |");
+	for (ways=1; ways <= profile->maxWays; ways = nextWays(ways, profile->maxWays))
+		tracePrintf(" %5d-way", ways);
+	tracePrintf("\n");
+	for (i=0; i < profile->numSizes; i++) {
+		for (j=0; j < profile->numSetCounts; j++) {
+			long long *hits = &profile->hits[(i * profile->numSetCounts + j) * profile->maxWays];
+			long long hitsSoFar = 0;
+			tracePrintf("%9d %12d |", 1 << i, 1 << j);
+			for (ways=1, depth=0; ways <= profile->maxWays; ways = nextWays(ways, profile->maxWays)) {
+				for (; depth < ways; depth++)
+					hitsSoFar += hits[depth];
+				tracePrintf(" %9.2f", profile->references > 0 ?
+					100.0 * (profile->references - hitsSoFar) / profile->references : 0.0);
+			}
+			tracePrintf("\n");
+		}
+	}
+}
+
+/* low-high, or a single value for both */
+void parseRange(char *spec, int *low, int *high) {
+	int count = sscanf(spec, "%d-%d", low, high);
+	if (count == 1)
+		*high = *low;
+	if (count < 1 || *low < 1 || *high < *low) {
+		tracePrintf("error: bad range %s\n", spec);
+		traceExit(1);
+	}
+}
+
+void collectReference(sweepType *sweep, int kind, int addr) {
+	if (sweep->numReferences == sweep->capacity) {
+		sweep->capacity = sweep->capacity ? 2 * sweep->capacity : 4096;
+		sweep->references = realloc(sweep->references, sweep->capacity * sizeof(int));
+		if (sweep->references == NULL) {
+			tracePrintf("error: out of memory for the references\n");
+			traceExit(1);
+		}
+	}
+	sweep->references[sweep->numReferences++] = kind * NUMMEMORY + addr;
+}
+
+/* simulate every configuration on the collected references and print a CSV table */
+void runSweep(sweepType *sweep) {
+	int policy, blockSize, numSets, blocksPerSet, i;
+	int count = 0;
+	for (policy=0; policy < NUMPOLICIES; policy++)
+		if (sweep->policies & 1 << policy)
+			for (blockSize = sweep->low[0]; blockSize <= sweep->high[0]; blockSize *= 2)
+				for (numSets = sweep->low[1]; numSets <= sweep->high[1]; numSets *= 2)
+					for (blocksPerSet = sweep->low[2]; blocksPerSet <= sweep->high[2]; blocksPerSet *= 2)
+						count++;
+	sweep->results = allocate(count, sizeof(sweepResultType));
+	sweep->numResults = 0;
+	for (policy=0; policy < NUMPOLICIES; policy++)
+		if (sweep->policies & 1 << policy)
+			for (blockSize = sweep->low[0]; blockSize <= sweep->high[0]; blockSize *= 2)
+				for (numSets = sweep->low[1]; numSets <= sweep->high[1]; numSets *= 2)
+					for (blocksPerSet = sweep->low[2]; blocksPerSet <= sweep->high[2]; blocksPerSet *= 2) {
+						sweepResultType *result = &sweep->results[sweep->numResults++];
+						result->policy = policy;
+						result->blockSize = blockSize;
+						result->numSets = numSets;
+						result->blocksPerSet = blocksPerSet;
+					}
+	sweep->nextResult = 0;
+	pthread_mutex_init(&sweep->lock, NULL);
+
+	/* no worker allocates more than this, and only here may that fail */
+	cacheType largest;
+	busType bus;
+	largest.policy = &policies[sweep->results[0].policy];
+	initCache(&largest, sweep->top[0], sweep->top[1], sweep->top[2]);
+	initBus(&bus, sweep->memoryLatency, sweep->bufferDepth, sweep->top[0]);
+	freeCache(&largest);
+	free(bus.addr);
+	free(bus.data);
+	free(bus.valid);
+
+	int numThreads = sweep->numThreads < count ? sweep->numThreads : count;
+	pthread_t threads[MAXTHREADS];
+	sweep->states = allocate(numThreads, sizeof(stateType));
+	sweep->nextState = 0;
+	for (i=0; i < numThreads; i++) {
+		sweep->states[i].quiet = 1;
+		if (pthread_create(&threads[i], NULL, sweepWorker, sweep) != 0) {
+			tracePrintf("error: can't start worker thread\n");
+			traceExit(1);
+		}
+	}
+	for (i=0; i < numThreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&sweep->lock);
+	free(sweep->states);
+
+	tracePrintf("policy,blockSizeInWords,numberOfSets,blocksPerSet,accesses,misses,missRate,writebacks,wordsRead,wordsWritten,averageAccessTime\n");
+	for (i=0; i < sweep->numResults; i++) {
+		sweepResultType *result = &sweep->results[i];
+		tracePrintf("%s,%d,%d,%d,%lld,%lld,%.4f,%lld,%lld,%lld,%.2f\n", policies[result->policy].name,
+			result->blockSize, result->numSets, result->blocksPerSet, result->accesses, result->misses,
+			result->accesses > 0 ? (double)result->misses / result->accesses : 0.0,
+			result->writebacks, result->wordsRead, result->wordsWritten, result->accessTime);
+	}
+	free(sweep->results);
+	free(sweep->references);
+}
+
+/*
+ * Sweep worker: take configurations until none are left, replaying the
+ * shared references through a private cache for each.
+ */
+void *sweepWorker(void *arg) {
+	sweepType *sweep = arg;
+	busType bus;
+	cacheType cache;
+	long long i;
+
+	pthread_mutex_lock(&sweep->lock);
+	stateType *state = &sweep->states[sweep->nextState++];
+	pthread_mutex_unlock(&sweep->lock);
+	state->bus = &bus;
+	for (;;) {
+		pthread_mutex_lock(&sweep->lock);
+		int next = sweep->nextResult++;
+		pthread_mutex_unlock(&sweep->lock);
+		if (next >= sweep->numResults)
+			break;
+		sweepResultType *result = &sweep->results[next];
+
+		cache.policy = &policies[result->policy];
+		cache.printStats = 0;
+		initCache(&cache, result->blockSize, result->numSets, result->blocksPerSet);
+		cache.latency = sweep->latency;
+		cache.writeThrough = sweep->writeThrough;
+		cache.writeAllocate = sweep->writeAllocate;
+		initBus(&bus, sweep->memoryLatency, sweep->bufferDepth, result->blockSize);
+
+		for (i=0; i < sweep->numReferences; i++) {
+			int kind = sweep->references[i] / NUMMEMORY;
+			int addr = sweep->references[i] % NUMMEMORY;
+			if (kind == fetchReference)
+				fetch(&cache, addr, state);
+			else if (kind == loadReference)
+				load(&cache, addr, state);
+			else
+				store(&cache, addr, 0, state);
+		}
+		while (bus.numEntries > 0)
+			drainEntry(state);
+
+		result->accesses = cache.accesses;
+		result->misses = cache.misses;
+		result->writebacks = cache.writebacks;
+		result->wordsRead = bus.wordsRead;
+		result->wordsWritten = bus.wordsWritten;
+		result->accessTime = averageAccessTime(&cache, &bus);
+		freeCache(&cache);
+		free(bus.addr);
+		free(bus.data);
+		free(bus.valid);
+	}
+	return NULL;
 }
 
 int main(int argc, char *argv[]) {
     int i;
-    char line[MAXLINELENGTH];
     stateType state;
-    cacheType cache;
+    cacheType cache, icache;
+    cacheType *level;
     FILE *filePtr;
+    char *progName = argv[0];
+    char *iSpec = NULL;
+    char **lowerSpecs = allocate(argc, sizeof(char *));
+    int numLower = 0;
+    int latency = 1, memoryLatency = 100, inclusion = nonInclusive;
+    int writeThrough = 0, writeAllocate = 1, bufferDepth = 0;
+    char *prefetchSpecs[2] = { NULL, NULL };
+    int allGeometries = 0, replaying = 0, sweeping = 0;
+    int policyMask = 1, numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    sweepType sweep;
+    char *recordName = NULL;
+    profileType profile;
+    busType bus;
+    int fields[4];
+
+    traceInit();
+
+    cache.policy = &policies[0];
+    cache.printStats = 0;
+
+    /*
+     * -r picks the replacement policy, -s prints hit rates at halt.  The
+     * positional geometry is the L1; -i splits off an instruction L1 of
+     * its own, each -L adds a level below the last, and -x sets how the
+     * lower levels include the ones above.  -t and -m are the L1 hit time
+     * and the memory latency in cycles.  -w and -a set how every level
+     * handles writes, and -b puts a write buffer of that many blocks in
+     * front of memory.  -P and -p pick prefetchers for the L1 serving
+     * instruction fetches and data accesses.  -A skips the cache and
+     * prints the LRU miss rate of every geometry up to the one given,
+     * whose block size and set count must be powers of two.  -R
+     * writes every reference to an address trace, and -T replays such a
+     * trace, given in place of the machine-code file, without running
+     * anything.  -S sweeps the design space instead: each geometry field
+     * may be a range low-high, stepped by doubling, with no cache larger
+     * than memory, -r may name several policies or all, and every
+     * configuration is simulated on -j threads and printed as a CSV table.
+     */
+    while (argc > 5 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-s")==0 || strcmp(argv[1], "-A")==0 || strcmp(argv[1], "-T")==0 || strcmp(argv[1], "-S")==0) {
+            if (argv[1][1] == 's')
+                cache.printStats = 1;
+            else if (argv[1][1] == 'A')
+                allGeometries = 1;
+            else if (argv[1][1] == 'T')
+                replaying = 1;
+            else
+                sweeping = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-r")==0) {
+            char *name = argv[2];
+            policyMask = 0;
+            do {
+                int length = strcspn(name, ",");
+                for (i=0; i<NUMPOLICIES && (strncmp(policies[i].name, name, length) || policies[i].name[length]); i++)
+                    ;
+                if (i < NUMPOLICIES)
+                    policyMask |= 1 << i;
+                else if (length == 3 && strncmp(name, "all", 3)==0)
+                    policyMask |= (1 << NUMPOLICIES) - 1;
+                else {
+                    tracePrintf("error: unknown replacement policy %s\n", argv[2]);
+                    traceExit(1);
+                }
+                name += length;
+            } while (*name++ == ',');
+            for (i=0; !(policyMask & 1 << i); i++)
+                ;
+            cache.policy = &policies[i];
+        } else if (strcmp(argv[1], "-j")==0) {
+            numThreads = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-R")==0) {
+            recordName = argv[2];
+        } else if (strcmp(argv[1], "-i")==0) {
+            iSpec = argv[2];
+        } else if (strcmp(argv[1], "-L")==0) {
+            lowerSpecs[numLower++] = argv[2];
+        } else if (strcmp(argv[1], "-t")==0) {
+            latency = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-m")==0) {
+            memoryLatency = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-w")==0) {
+            if (strcmp(argv[2], "back") && strcmp(argv[2], "through")) {
+                tracePrintf("error: unknown write policy %s\n", argv[2]);
+                traceExit(1);
+            }
+            writeThrough = strcmp(argv[2], "through")==0;
+        } else if (strcmp(argv[1], "-a")==0) {
+            if (strcmp(argv[2], "allocate") && strcmp(argv[2], "noallocate")) {
+                tracePrintf("error: unknown write miss policy %s\n", argv[2]);
+                traceExit(1);
+            }
+            writeAllocate = strcmp(argv[2], "allocate")==0;
+        } else if (strcmp(argv[1], "-b")==0) {
+            bufferDepth = atoi(argv[2]);
+            if (bufferDepth < 0) {
+                tracePrintf("error: write buffer depth must not be negative\n");
+                traceExit(1);
+            }
+        } else if (strcmp(argv[1], "-P")==0) {
+            prefetchSpecs[instructionAccess] = argv[2];
+        } else if (strcmp(argv[1], "-p")==0) {
+            prefetchSpecs[dataAccess] = argv[2];
+        } else if (strcmp(argv[1], "-x")==0) {
+            for (inclusion=0; inclusion<3 && strcmp(inclusionNames[inclusion], argv[2]); inclusion++)
+                ;
+            if (inclusion == 3) {
+                tracePrintf("error: unknown inclusion policy %s\n", argv[2]);
+                traceExit(1);
+            }
+        } else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
 
     if (argc != 5) {
-		printf("error: usage: %s <machine-code file> <blockSizeInWords> <numberOfSets> <blocksPerSet>\n", argv[0]);
-		exit(1);
+		tracePrintf("error: usage: %s [-A] [-r lru|plru|fifo|random|rrip] [-s] [-i B,S,W] [-L B,S,W,cycles]... [-x noninclusive|inclusive|exclusive] [-t cycles] [-m cycles] [-w back|through] [-a allocate|noallocate] [-b depth] [-P|-p nextline|stride|stream[,degree]] [-R trace] [-T] [-S [-j threads]] <machine-code file or trace> <blockSizeInWords> <numberOfSets> <blocksPerSet>\n", progName);
+		traceExit(1);
+    }
+    if (!sweeping && (policyMask & (policyMask - 1))) {
+		tracePrintf("error: only a sweep can take more than one replacement policy\n");
+		traceExit(1);
+    }
+    if (sweeping) {
+		if (allGeometries || iSpec != NULL || numLower > 0 || prefetchSpecs[0] != NULL || prefetchSpecs[1] != NULL) {
+			tracePrintf("error: a sweep is of a single cache, without -A, -i, -L, -P or -p\n");
+			traceExit(1);
+		}
+		for (i=0; i<3; i++)
+			parseRange(argv[i + 2], &sweep.low[i], &sweep.high[i]);
+		/*
+		 * checked here, since the workers can't stop the run; a cache of
+		 * more words than memory never evicts, so it adds nothing
+		 */
+		long long words = 1;
+		for (i=0; i<3; i++) {
+			if (sweep.high[i] > NUMMEMORY) {
+				tracePrintf("error: a sweep range can't go past %d\n", NUMMEMORY);
+				traceExit(1);
+			}
+			for (sweep.top[i] = sweep.low[i]; sweep.top[i] * 2 <= sweep.high[i]; sweep.top[i] *= 2)
+				;
+			words *= sweep.top[i];
+		}
+		if (words > NUMMEMORY) {
+			tracePrintf("error: the sweep's largest cache holds %lld words, more than the %d of memory\n", words, NUMMEMORY);
+			traceExit(1);
+		}
+		if ((policyMask & 1 << 1) && (sweep.low[2] & (sweep.low[2] - 1)) != 0) {
+			tracePrintf("error: plru needs a power of two blocksPerSet\n");
+			traceExit(1);
+		}
+		sweep.policies = policyMask;
+		sweep.numThreads = numThreads < 1 ? 1 : numThreads > MAXTHREADS ? MAXTHREADS : numThreads;
+		sweep.references = NULL;
+		sweep.numReferences = 0;
+		sweep.capacity = 0;
+    }
+
+    initCache(&cache, atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    if (iSpec != NULL) {
+		parseGeometry(iSpec, fields, 3);
+		icache.policy = cache.policy;
+		icache.printStats = 0;
+		initCache(&icache, fields[0], fields[1], fields[2]);
+		cache.sibling = &icache;
+		icache.sibling = &cache;
+		strcpy(icache.name, "L1I");
+		strcpy(cache.name, "L1D");
+		icache.latency = latency;
+    } else if (numLower > 0)
+		strcpy(cache.name, "L1");
+    cache.latency = latency;
+
+    /* the lower levels, each serving every level just above it */
+    level = &cache;
+    for (i=0; i<numLower; i++) {
+		cacheType *lower = allocate(1, sizeof(cacheType));
+		parseGeometry(lowerSpecs[i], fields, 4);
+		lower->policy = cache.policy;
+		lower->printStats = 0;
+		initCache(lower, fields[0], fields[1], fields[2]);
+		sprintf(lower->name, "L%d", i + 2);
+		lower->latency = fields[3];
+		lower->inclusion = inclusion;
+		lower->upper[lower->numUpper++] = level;
+		if (level == &cache && iSpec != NULL)
+			lower->upper[lower->numUpper++] = &icache;
+		level->next = lower;
+		if (level == &cache && iSpec != NULL)
+			icache.next = lower;
+		level = lower;
     }
+    free(lowerSpecs);
 
-    cache.blockSize = atoi(argv[2]); /* Maximum 256 */
-    cache.numSets = atoi(argv[3]);
-    cache.blocksPerSet = atoi(argv[4]); /* 1 to blockSize */
-    cache.SIZE = cache.blockSize * cache.numSets * cache.blocksPerSet;
-
-    int j;
-    for (i=0; i<MAXBLOCKS; i++) {
-    	for (j=0; j<MAXBLOCKSIZE; j++) {
-    		cache.sets[i].dirty[j] = 0;
-    		cache.sets[i].valid[j] = 0;
-    	}
+    /* a level's blocks hold whole blocks of the levels above; exclusive levels trade blocks as they are */
+    for (level = cache.next; level != NULL; level = level->next) {
+		for (i=0; i<level->numUpper; i++) {
+			if (level->blockSize % level->upper[i]->blockSize != 0 ||
+					(inclusion == exclusive && level->blockSize != level->upper[i]->blockSize)) {
+				tracePrintf("error: %s blocks must be %s the %s blocks\n", level->name,
+					inclusion == exclusive ? "the same size as" : "a whole multiple of", level->upper[i]->name);
+				traceExit(1);
+			}
+		}
+    }
+    /* the write buffer holds blocks of the level next to memory */
+    int bufferBlock = (iSpec != NULL && icache.blockSize > cache.blockSize) ? icache.blockSize : cache.blockSize;
+    for (level = &cache; level != NULL; level = level->next) {
+		level->writeThrough = writeThrough;
+		level->writeAllocate = writeAllocate;
+		if (level->next == NULL && level != &cache)
+			bufferBlock = level->blockSize;
+    }
+    initBus(&bus, memoryLatency, bufferDepth, bufferBlock);
+
+    for (i=0; i<2; i++) {
+		if (prefetchSpecs[i] == NULL)
+			continue;
+		level = (i == instructionAccess && iSpec != NULL) ? &icache : &cache;
+		level->prefetcher[i] = newPrefetcher(prefetchSpecs[i], i);
+    }
+    state.bus = &bus;
+    state.profile = NULL;
+    if (allGeometries) {
+		initProfile(&profile, atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+		state.profile = &profile;
+    }
+    state.sweep = NULL;
+    if (sweeping) {
+		sweep.latency = latency;
+		sweep.memoryLatency = memoryLatency;
+		sweep.writeThrough = writeThrough;
+		sweep.writeAllocate = writeAllocate;
+		sweep.bufferDepth = bufferDepth;
+		state.sweep = &sweep;
+    }
+    state.quiet = 0;
+    state.recording = NULL;
+    if (recordName != NULL) {
+		state.recording = fopen(recordName, "wb");
+		if (state.recording == NULL) {
+			tracePrintf("error: can't open file %s\n", recordName);
+			perror("fopen");
+			traceExit(1);
+		}
+		fputs(TRACEMAGIC, state.recording);
+		for (i=0; i<3; i++)
+			state.lastRecorded[i] = 0;
     }
 
     /* initialize memories and registers */
@@ -281,34 +1798,35 @@ int main(int argc, char *argv[]) {
 		state.reg[i] = 0;
     state.pc=0;
 
+    if (replaying) {
+		replay(iSpec != NULL ? &icache : &cache, &cache, &state, argv[1]);
+		return(0);
+    }
+
     /* read machine-code file into instruction/data memory (starting at
 	address 0) */
 
     filePtr = fopen(argv[1], "r");
     if (filePtr == NULL) {
-		printf("error: can't open file %s\n", argv[1]);
+		tracePrintf("error: can't open file %s\n", argv[1]);
 		perror("fopen");
-		exit(1);
+		traceExit(1);
     }
 
-    for (state.numMemory=0; fgets(line, MAXLINELENGTH, filePtr) != NULL; state.numMemory++) {
-		if (state.numMemory >= NUMMEMORY) {
-		    printf("exceeded memory size\n");
-		    exit(1);
-		}
-		if (sscanf(line, "%d", state.mem+state.numMemory) != 1) {
-		    printf("error in reading address %d\n", state.numMemory);
-		    exit(1);
-		}
-    }
+    int entry;
+    state.numMemory = loadImage(filePtr, state.mem, NUMMEMORY, &entry);
+    fclose(filePtr);
+    if (state.numMemory < 0)
+		traceExit(1);
+    state.pc = entry;
     
     /* run never returns */
-    run(cache, state);
+    run(iSpec != NULL ? &icache : &cache, &cache, state);
 
     return(0);
 }
 
-void run(cacheType cache, stateType state) {
+void run(cacheType *icache, cacheType *dcache, stateType state) {
     int arg0, arg1, arg2, addressField;
     int instructions=0;
     int opcode;
@@ -317,13 +1835,13 @@ void run(cacheType cache, stateType state) {
     for (; 1; instructions++) { /* infinite loop, exits when it executes halt */
 
 		if (state.pc < 0 || state.pc >= NUMMEMORY) {
-		    printf("pc went out of the memory range\n");
-		    exit(1);
+		    tracePrintf("pc went out of the memory range\n");
+		    traceExit(1);
 		}
 
 		maxMem = (state.pc > maxMem)?state.pc:maxMem;
 
-		int instruction = load(&cache, state.pc, &state);
+		int instruction = fetch(icache, state.pc, &state);
 
 		/* this is to make the following code easier to read */
 		opcode = instruction >> 22;
@@ -342,19 +1860,19 @@ void run(cacheType cache, stateType state) {
 
 		} else if (opcode == LW) {
 		    if (state.reg[arg0] + addressField < 0 || state.reg[arg0] + addressField >= NUMMEMORY) {
-				printf("address out of bounds\n");
-				exit(1);
+				tracePrintf("address out of bounds\n");
+				traceExit(1);
 		    }
-		    state.reg[arg1] = load(&cache, state.reg[arg0] + addressField, &state);
+		    state.reg[arg1] = load(dcache, state.reg[arg0] + addressField, &state);
 		    if (state.reg[arg0] + addressField > maxMem)
 				maxMem = state.reg[arg0] + addressField;
 
 		} else if (opcode == SW) {
 		    if (state.reg[arg0] + addressField < 0 || state.reg[arg0] + addressField >= NUMMEMORY) {
-				printf("address out of bounds\n");
-				exit(1);
+				tracePrintf("address out of bounds\n");
+				traceExit(1);
 		    }
-		    store(&cache, state.reg[arg0] + addressField, state.reg[arg1], &state);
+		    store(dcache, state.reg[arg0] + addressField, state.reg[arg1], &state);
 		    if (state.reg[arg0] + addressField > maxMem)
 				maxMem = state.reg[arg0] + addressField;
 
@@ -372,13 +1890,108 @@ void run(cacheType cache, stateType state) {
 		} else if (opcode == NOOP) {
 
 		} else if (opcode == HALT) {
-		    exit(0);
+		    halt(icache, dcache, &state);
 
 		} else {
-		    printf("error: illegal opcode 0x%x\n", opcode);
-		    exit(1);
+		    tracePrintf("error: illegal opcode 0x%x\n", opcode);
+		    traceExit(1);
 
 		}
         state.reg[0] = 0;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Drive the caches from an address trace written by -R instead of running
+ * a program: each fetch, load and store in it is replayed in order, stores
+ * writing 0 since the trace keeps no values.  Ends as a halt would.
+ */
+void replay(cacheType *icache, cacheType *dcache, stateType *state, char *fileName) {
+	struct stat info;
+	int last[3] = { 0, 0, 0 };
+	int fd = open(fileName, O_RDONLY);
+	if (fd < 0) {
+		tracePrintf("error: can't open file %s\n", fileName);
+		perror("open");
+		traceExit(1);
+	}
+	if (fstat(fd, &info) < 0 || info.st_size < (off_t)strlen(TRACEMAGIC)) {
+		tracePrintf("error: %s is not an address trace\n", fileName);
+		traceExit(1);
+	}
+	size_t length = info.st_size;
+	unsigned char *trace = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace == MAP_FAILED) {
+		tracePrintf("error: can't map file %s\n", fileName);
+		perror("mmap");
+		traceExit(1);
+	}
+	if (memcmp(trace, TRACEMAGIC, strlen(TRACEMAGIC))) {
+		tracePrintf("error: %s is not an address trace\n", fileName);
+		traceExit(1);
+	}
+
+	size_t next = strlen(TRACEMAGIC);
+	while (next < length) {
+		int kind = trace[next] >> 6;
+		unsigned int rest = trace[next] & 0x1f;
+		int shift = 5;
+		while (trace[next++] & (shift == 5 ? 0x20 : 0x80)) {
+			if (next == length || shift > 31) {
+				tracePrintf("error: address trace %s is corrupt\n", fileName);
+				traceExit(1);
+			}
+			rest |= (unsigned int)(trace[next] & 0x7f) << shift;
+			shift += 7;
+		}
+		int addr = last[kind] + (int)((rest >> 1) ^ -(rest & 1));
+		if (kind > storeReference || addr < 0 || addr >= NUMMEMORY) {
+			tracePrintf("error: address trace %s is corrupt\n", fileName);
+			traceExit(1);
+		}
+		last[kind] = addr;
+
+		if (kind == fetchReference) {
+			fetch(icache, addr, state);
+			state->pc = addr + 1; /* as run() leaves it for the prefetchers */
+		} else if (kind == loadReference)
+			load(dcache, addr, state);
+		else
+			store(dcache, addr, 0, state);
+	}
+
+	munmap(trace, length);
+	close(fd);
+	halt(icache, dcache, state);
+}
+
+/* finish the run: drain the write buffer, print what was asked for, free everything and exit */
+void halt(cacheType *icache, cacheType *dcache, stateType *state) {
+	/* what is still in the write buffer reaches memory eventually */
+	while (state->bus->numEntries > 0)
+		drainEntry(state);
+	if (state->recording != NULL)
+		fclose(state->recording);
+	if (state->profile != NULL) {
+		printProfile(state->profile);
+		free(state->profile->offset);
+		free(state->profile->stacks);
+		free(state->profile->hits);
+	} else if (state->sweep != NULL)
+		runSweep(state->sweep);
+	else if (dcache->printStats)
+		printStats(icache, dcache, state->bus);
+	if (icache != dcache)
+		freeCache(icache);
+	freeCache(dcache);
+	free(state->bus->addr);
+	free(state->bus->data);
+	free(state->bus->valid);
+	while (dcache->next != NULL) {
+		cacheType *lower = dcache->next;
+		dcache->next = lower->next;
+		freeCache(lower);
+		free(lower);
+	}
+	traceExit(0);
+}